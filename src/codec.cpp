@@ -7,13 +7,77 @@
 #include <iomanip>
 #include <vector>
 #include <cstdio>
+#include <cstring>
+#include <cmath>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
 
 #include <cv.h>
 #include <highgui.h>
 
-#include <boost/program_options.hpp>
+#include "codec.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// ===============================================================================================
+//
+// CPU features
+//
+// ===============================================================================================
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*!
+ * Instruction sets of the CPU running the codec. Kernels needing more than
+ * the build targets are compiled for their instruction set with target
+ * attributes and called only if the CPU has it.
+ */
+struct CpuFeatures {
+	CpuFeatures() {
+		// may run before the constructor filling CPU features
+		__builtin_cpu_init();
+		ssse3 = __builtin_cpu_supports("ssse3");
+		sse42 = __builtin_cpu_supports("sse4.2");
+		avx2 = __builtin_cpu_supports("avx2");
+		pclmul = __builtin_cpu_supports("pclmul");
+	}
+
+	bool ssse3;
+	bool sse42;
+	bool avx2;
+	bool pclmul;
+};
+
+static const CpuFeatures cpu;
+
+// instruction sets the build targets are there whatever the CPU reports
+#if defined(__SSSE3__)
+static const bool has_ssse3 = true;
+#else
+static const bool has_ssse3 = cpu.ssse3;
+#endif
+#if defined(__SSE4_2__)
+static const bool has_sse42 = true;
+#else
+static const bool has_sse42 = cpu.sse42;
+#endif
+#if defined(__AVX2__)
+static const bool has_avx2 = true;
+#else
+static const bool has_avx2 = cpu.avx2;
+#endif
+#if defined(__PCLMUL__)
+static const bool has_pclmul = true;
+#else
+static const bool has_pclmul = cpu.pclmul;
+#endif
+#endif
 
 // ===============================================================================================
 //
@@ -21,6 +85,25 @@
 //
 // ===============================================================================================
 
+template <typename T>
+static void getBitPlaneRows(const cv::Mat & img, cv::Mat & result, int plane, cv::Size size) {
+	int mask = 1 << plane;
+
+	for (int y = 0; y < size.height; ++y) {
+
+		const T* img_p = img.ptr <T> (y);
+		uchar* res_p = result.ptr <uchar> (y);
+
+		for (int x = 0; x < size.width; ++x) {
+			res_p[x] = (img_p[x] & mask) ? 255 : 0;
+		}
+
+	}
+}
+
+/*!
+ * Bit \a plane of every pixel of 8 or 16-bit \a img, as 8-bit image of 0 and 255.
+ */
 cv::Mat getBitPlane(const cv::Mat & img, int plane) {
 
 	if (img.channels() != 1) {
@@ -28,37 +111,57 @@ cv::Mat getBitPlane(const cv::Mat & img, int plane) {
 		return cv::Mat();
 	}
 
-	cv::Mat result = img.clone();
+	cv::Mat result(img.size(), CV_8UC1);
 	cv::Size size = img.size();
 
-	int mask = 1 << plane;
-
 	if (img.isContinuous() && result.isContinuous()) {
 		size.width *= size.height;
 		size.height = 1;
 	}
 
+	if (img.depth() == CV_16U)
+		getBitPlaneRows<uint16_t>(img, result, plane, size);
+	else
+		getBitPlaneRows<uchar>(img, result, plane, size);
+
+	return result;
+}
+
+template <typename T>
+static void mergeBitPlaneRows(const std::vector<cv::Mat> & planes, cv::Mat & result, cv::Size size) {
+	int n = planes.size();
+
 	for (int y = 0; y < size.height; ++y) {
 
-		const uchar* img_p = img.ptr <uchar> (y);
-		uchar* res_p = result.ptr <uchar> (y);
+		const uchar* img_p[MAX_DEPTH];
+		for (int i = 0; i < n; ++i)
+			img_p[i] = planes[i].ptr <uchar> (y);
+
+		T* res_p = result.ptr <T> (y);
 
 		for (int x = 0; x < size.width; ++x) {
-			res_p[x] = (img_p[x] & mask) ? 255 : 0;
+			T val = 0;
+			for (int i = n; i > 0; --i) {
+				val <<= 1;
+				val += img_p[i-1][x] > 0 ? 1 : 0;
+			}
+			res_p[x] = val;
 		}
 
 	}
-
-	return result;
 }
 
+/*!
+ * Merges planes (lowest first) back into image, 8-bit for up to 8 planes,
+ * 16-bit for more.
+ */
 cv::Mat mergeBitPlanes(const std::vector<cv::Mat> & planes) {
-	if (planes.size() != 8) {
-		std::cout << "mergeBitPlanes: must be planes.size() == 8!\n";
+	if (planes.size() < 1 || planes.size() > MAX_DEPTH) {
+		std::cout << "mergeBitPlanes: must be 1 <= planes.size() <= " << MAX_DEPTH << "!\n";
 		return cv::Mat();
 	}
 
-	cv::Mat result = planes[0].clone();
+	cv::Mat result(planes[0].size(), planes.size() > 8 ? CV_16UC1 : CV_8UC1);
 	cv::Size size = result.size();
 
 	bool cont = true;
@@ -76,28 +179,146 @@ cv::Mat mergeBitPlanes(const std::vector<cv::Mat> & planes) {
 		size.height = 1;
 	}
 
-	for (int y = 0; y < size.height; ++y) {
+	if (planes.size() > 8)
+		mergeBitPlaneRows<uint16_t>(planes, result, size);
+	else
+		mergeBitPlaneRows<uchar>(planes, result, size);
 
-		const uchar* img_p[8];
-		for (int i = 0; i < 8; ++i)
-			img_p[i] = planes[i].ptr <uchar> (y);
+	return result;
+}
 
-		uchar* res_p = result.ptr <uchar> (y);
+// ===============================================================================================
+//
+// Packed bit planes
+//
+// ===============================================================================================
 
-		for (int x = 0; x < size.width; ++x) {
-			uchar val = 0;
-			for (int i = 8; i > 0; --i) {
-				val <<= 1;
-				val += img_p[i-1][x] > 0 ? 1 : 0;
-			}
-			res_p[x] = val;
+#if defined(__x86_64__) && defined(__GNUC__)
+/*!
+ * Packs 32 pixels at a time while whole 32 are left, returns number of pixels
+ * packed.
+ */
+__attribute__((target("avx2")))
+static int packRowAvx2(const uchar * img_p, uint64_t * res_p, int plane, int n) {
+	int x = 0;
+	// move the plane bit to the top of each byte and gather top bits
+	for (; x + 32 <= n; x += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(img_p + x));
+		uint32_t bits = _mm256_movemask_epi8(_mm256_slli_epi16(v, 7 - plane));
+		res_p[x >> 6] |= (uint64_t)bits << (x & 63);
+	}
+	return x;
+}
+#endif
+
+static void packRows(const cv::Mat & img, int plane, PackedPlane & result, uchar) {
+	int mask = 1 << plane;
+
+	for (int y = 0; y < result.height; ++y) {
+
+		const uchar* img_p = img.ptr <uchar> (y);
+		uint64_t* res_p = result.row(y);
+
+		int x = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+		if (has_avx2)
+			x = packRowAvx2(img_p, res_p, plane, result.width);
+#endif
+#if defined(__SSE2__)
+		for (; x + 16 <= result.width; x += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(img_p + x));
+			uint32_t bits = _mm_movemask_epi8(_mm_slli_epi16(v, 7 - plane));
+			res_p[x >> 6] |= (uint64_t)bits << (x & 63);
 		}
+#endif
+		for (; x < result.width; ++x)
+			if (img_p[x] & mask)
+				res_p[x >> 6] |= (uint64_t)1 << (x & 63);
+	}
+}
 
+static void packRows(const cv::Mat & img, int plane, PackedPlane & result, uint16_t) {
+	int mask = 1 << plane;
+
+	for (int y = 0; y < result.height; ++y) {
+
+		const uint16_t* img_p = img.ptr <uint16_t> (y);
+		uint64_t* res_p = result.row(y);
+
+		int x = 0;
+#if defined(__SSE2__)
+		// spread the plane bit over each 16-bit lane, pack lanes to bytes and
+		// gather their top bits
+		for (; x + 16 <= result.width; x += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(img_p + x));
+			__m128i b = _mm_loadu_si128((const __m128i*)(img_p + x + 8));
+			a = _mm_srai_epi16(_mm_slli_epi16(a, 15 - plane), 15);
+			b = _mm_srai_epi16(_mm_slli_epi16(b, 15 - plane), 15);
+			uint32_t bits = _mm_movemask_epi8(_mm_packs_epi16(a, b));
+			res_p[x >> 6] |= (uint64_t)bits << (x & 63);
+		}
+#endif
+		for (; x < result.width; ++x)
+			if (img_p[x] & mask)
+				res_p[x >> 6] |= (uint64_t)1 << (x & 63);
 	}
+}
 
+/*!
+ * Packs bit \a plane of every pixel of 8 or 16-bit \a img.
+ */
+PackedPlane packPlane(const cv::Mat & img, int plane) {
+	PackedPlane result;
+	packPlane(img, plane, result);
 	return result;
 }
 
+void packPlane(const cv::Mat & img, int plane, PackedPlane & result) {
+	result.reset(img.size().width, img.size().height);
+
+	if (img.depth() == CV_16U)
+		packRows(img, plane, result, uint16_t());
+	else
+		packRows(img, plane, result, uchar());
+}
+
+/*!
+ * Lookup table spreading 8 bits into the lowest bits of 8 bytes, used to
+ * transpose packed planes back to pixels.
+ */
+struct SpreadTable {
+	SpreadTable() {
+		for (int b = 0; b < 256; ++b) {
+			v[b] = 0;
+			for (int i = 0; i < 8; ++i)
+				if (b & (1 << i))
+					v[b] |= (uint64_t)1 << (8 * i);
+		}
+	}
+
+	uint64_t v[256];
+};
+
+static const SpreadTable spread_table;
+
+/*!
+ * Lookup table spreading 4 bits into the lowest bits of 4 16-bit lanes.
+ */
+struct SpreadTable16 {
+	SpreadTable16() {
+		for (int b = 0; b < 16; ++b) {
+			v[b] = 0;
+			for (int i = 0; i < 4; ++i)
+				if (b & (1 << i))
+					v[b] |= (uint64_t)1 << (16 * i);
+		}
+	}
+
+	uint64_t v[16];
+};
+
+static const SpreadTable16 spread_table16;
+
 // ===============================================================================================
 //
 // NKB2GRAY
@@ -129,14 +350,187 @@ static uchar graydecode(uchar b) {
    return b;
  }
 
-cv::Mat nkb2gray(const cv::Mat & img, bool reverse = false) {
+static uint16_t graycode(uint16_t i)
+{
+	return i ^ (i >> 1);
+}
+
+static uint16_t graydecode(uint16_t b) {
+	b ^= b >> 1;
+	b ^= b >> 2;
+	b ^= b >> 4;
+	b ^= b >> 8;
+
+	return b;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+ * AVX2 kernels of the row functions below, they code whole 32 bytes at a time
+ * and return number of pixels done.
+ */
+__attribute__((target("avx2")))
+static int graycodeRowAvx2(const uchar * src, uchar * dst, int n) {
+	int x = 0;
+	const __m256i lo7 = _mm256_set1_epi8(0x7F);
+	for (; x + 32 <= n; x += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(src + x));
+		__m256i s = _mm256_and_si256(_mm256_srli_epi16(v, 1), lo7);
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm256_xor_si256(v, s));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static int graydecodeRowAvx2(const uchar * src, uchar * dst, int n) {
+	int x = 0;
+	const __m256i m1 = _mm256_set1_epi8(0x7F);
+	const __m256i m2 = _mm256_set1_epi8(0x3F);
+	const __m256i m4 = _mm256_set1_epi8(0x0F);
+	for (; x + 32 <= n; x += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(src + x));
+		v = _mm256_xor_si256(v, _mm256_and_si256(_mm256_srli_epi16(v, 1), m1));
+		v = _mm256_xor_si256(v, _mm256_and_si256(_mm256_srli_epi16(v, 2), m2));
+		v = _mm256_xor_si256(v, _mm256_and_si256(_mm256_srli_epi16(v, 4), m4));
+		_mm256_storeu_si256((__m256i*)(dst + x), v);
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static int graycodeRowAvx2(const uint16_t * src, uint16_t * dst, int n) {
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(src + x));
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm256_xor_si256(v, _mm256_srli_epi16(v, 1)));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static int graydecodeRowAvx2(const uint16_t * src, uint16_t * dst, int n) {
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(src + x));
+		v = _mm256_xor_si256(v, _mm256_srli_epi16(v, 1));
+		v = _mm256_xor_si256(v, _mm256_srli_epi16(v, 2));
+		v = _mm256_xor_si256(v, _mm256_srli_epi16(v, 4));
+		v = _mm256_xor_si256(v, _mm256_srli_epi16(v, 8));
+		_mm256_storeu_si256((__m256i*)(dst + x), v);
+	}
+	return x;
+}
+#endif
+
+/*!
+ * Gray codes \a n pixels of \a src into \a dst (may be the same row).
+ */
+static void graycodeRow(const uchar * src, uchar * dst, int n) {
+	int x = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (has_avx2)
+		x = graycodeRowAvx2(src, dst, n);
+#endif
+#if defined(__SSE2__)
+	const __m128i lo7_128 = _mm_set1_epi8(0x7F);
+	for (; x + 16 <= n; x += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+		__m128i s = _mm_and_si128(_mm_srli_epi16(v, 1), lo7_128);
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_xor_si128(v, s));
+	}
+#endif
+	for (; x < n; ++x)
+		dst[x] = graycode(src[x]);
+}
+
+/*!
+ * Decodes \a n Gray coded pixels of \a src into \a dst (may be the same row).
+ * Per byte prefix-XOR done with three shift steps, bytes masked after each
+ * 16-bit lane shift so that no bits leak between neighbouring pixels.
+ */
+static void graydecodeRow(const uchar * src, uchar * dst, int n) {
+	int x = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (has_avx2)
+		x = graydecodeRowAvx2(src, dst, n);
+#endif
+#if defined(__SSE2__)
+	const __m128i n1 = _mm_set1_epi8(0x7F);
+	const __m128i n2 = _mm_set1_epi8(0x3F);
+	const __m128i n4 = _mm_set1_epi8(0x0F);
+	for (; x + 16 <= n; x += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+		v = _mm_xor_si128(v, _mm_and_si128(_mm_srli_epi16(v, 1), n1));
+		v = _mm_xor_si128(v, _mm_and_si128(_mm_srli_epi16(v, 2), n2));
+		v = _mm_xor_si128(v, _mm_and_si128(_mm_srli_epi16(v, 4), n4));
+		_mm_storeu_si128((__m128i*)(dst + x), v);
+	}
+#endif
+	for (; x < n; ++x)
+		dst[x] = graydecode(src[x]);
+}
+
+/*!
+ * 16-bit variant, lanes are as wide as pixels, so no masking is needed.
+ */
+static void graycodeRow(const uint16_t * src, uint16_t * dst, int n) {
+	int x = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (has_avx2)
+		x = graycodeRowAvx2(src, dst, n);
+#endif
+#if defined(__SSE2__)
+	for (; x + 8 <= n; x += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_xor_si128(v, _mm_srli_epi16(v, 1)));
+	}
+#endif
+	for (; x < n; ++x)
+		dst[x] = graycode(src[x]);
+}
+
+static void graydecodeRow(const uint16_t * src, uint16_t * dst, int n) {
+	int x = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (has_avx2)
+		x = graydecodeRowAvx2(src, dst, n);
+#endif
+#if defined(__SSE2__)
+	for (; x + 8 <= n; x += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+		v = _mm_xor_si128(v, _mm_srli_epi16(v, 1));
+		v = _mm_xor_si128(v, _mm_srli_epi16(v, 2));
+		v = _mm_xor_si128(v, _mm_srli_epi16(v, 4));
+		v = _mm_xor_si128(v, _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i*)(dst + x), v);
+	}
+#endif
+	for (; x < n; ++x)
+		dst[x] = graydecode(src[x]);
+}
+
+template <typename T>
+static void nkb2grayRows(const cv::Mat & img, cv::Mat & result, bool reverse, cv::Size size) {
+	for (int y = 0; y < size.height; ++y) {
+
+		const T* img_p = img.ptr <T> (y);
+		T* res_p = result.ptr <T> (y);
+
+		if (reverse)
+			graydecodeRow(img_p, res_p, size.width);
+		else
+			graycodeRow(img_p, res_p, size.width);
+	}
+}
+
+cv::Mat nkb2gray(const cv::Mat & img, bool reverse) {
 
 	if (img.channels() != 1) {
 		std::cout << "getBitPlane: img must be one channel!\n";
 		return cv::Mat();
 	}
 
-	cv::Mat result = img.clone();
+	cv::Mat result(img.size(), img.type());
 	cv::Size size = img.size();
 
 	if (img.isContinuous() && result.isContinuous()) {
@@ -144,402 +538,864 @@ cv::Mat nkb2gray(const cv::Mat & img, bool reverse = false) {
 		size.height = 1;
 	}
 
-	for (int y = 0; y < size.height; ++y) {
-
-		const uchar* img_p = img.ptr <uchar> (y);
-		uchar* res_p = result.ptr <uchar> (y);
-
-		for (int x = 0; x < size.width; ++x)
-			if (reverse)
-				res_p[x] = graydecode(img_p[x]);
-			else
-				res_p[x] = graycode(img_p[x]);
-
-
-	}
+	if (img.depth() == CV_16U)
+		nkb2grayRows<uint16_t>(img, result, reverse, size);
+	else
+		nkb2grayRows<uchar>(img, result, reverse, size);
 
 	return result;
 }
 
 // ===============================================================================================
 //
-// RLE
+// Fused channel transforms
 //
 // ===============================================================================================
 
-struct RLEHeader {
-	uint8_t first_symbol;
-	uint16_t width;
-	uint16_t height;
-	uint8_t type;
-};
+/*!
+ * Prediction of a pixel from its neighbours, each bit plane selected by one
+ * of the masks is predicted with the corresponding predictor. As all
+ * predictors are bitwise, this codes all planes of a pixel at once.
+ */
+template <typename T>
+static inline T predict(T left, T up, T upleft, T left_mask, T up_mask, T maj_mask) {
+	T maj = (left & up) | (left & upleft) | (up & upleft);
+	return (left & left_mask) | (up & up_mask) | (maj & maj_mask);
+}
+
+static void predictorMasks(const std::vector<int> & predictors, int & left_mask, int & up_mask, int & maj_mask) {
+	left_mask = up_mask = maj_mask = 0;
+	for (int p = 0; p < predictors.size(); ++p) {
+		if (predictors[p] == PRED_LEFT)
+			left_mask |= 1 << p;
+		else if (predictors[p] == PRED_UP)
+			up_mask |= 1 << p;
+		else if (predictors[p] == PRED_MAJORITY)
+			maj_mask |= 1 << p;
+	}
+}
 
 template <typename T>
-static std::string binary(T i)
-{
-	std::string result;
-	for (int bit = 0; bit < sizeof(T)*8; ++bit) {
-		result = (char)((i & 1) + '0') + result;
-		i >>= 1;
+static void encodeRows(const cv::Mat & img, cv::Mat & result, bool gray) {
+	cv::Size size = img.size();
+
+	for (int y = 0; y < size.height; ++y) {
+
+		const T* img_p = img.ptr <T> (y);
+		T* res_p = result.ptr <T> (y);
+
+		if (gray)
+			graycodeRow(img_p, res_p, size.width);
+		else
+			memcpy(res_p, img_p, size.width * sizeof(T));
 	}
+}
+
+/*!
+ * Gray codes whole channel in a single pass.
+ *
+ * Bit p of every result pixel is the coded bit plane p, so the result can be fed
+ * straight to rle(img, plane, type) instead of going through nkb2gray() and
+ * getBitPlane(). Works on 8 and 16-bit channels, result has the same depth.
+ */
+cv::Mat encodeChannel(const cv::Mat & img, bool gray) {
+	cv::Mat result;
+	encodeChannel(img, gray, result);
 	return result;
 }
 
-struct RleCodebook {
-	RleCodebook(int type) : INTERVALS(7), m_type(type) {
-		prefixes[0] = 0x00;
-		prefixes[1] = 0x02;
-		prefixes[2] = 0x06;
-		prefixes[3] = 0x0E;
-		prefixes[4] = 0x1E;
-		prefixes[5] = 0x3E;
-		prefixes[6] = 0x7E;
-
-		pref_msk[0] = 0x80;
-		pref_msk[1] = 0xC0;
-		pref_msk[2] = 0xE0;
-		pref_msk[3] = 0xF0;
-		pref_msk[4] = 0xF8;
-		pref_msk[5] = 0xFC;
-		pref_msk[6] = 0xFE;
-
-		pref_res[0] = 0x00;
-		pref_res[1] = 0x80;
-		pref_res[2] = 0xC0;
-		pref_res[3] = 0xE0;
-		pref_res[4] = 0xF0;
-		pref_res[5] = 0xF8;
-		pref_res[6] = 0xFc;
-
-		pref_len[0] = 1;
-		pref_len[1] = 2;
-		pref_len[2] = 3;
-		pref_len[3] = 4;
-		pref_len[4] = 5;
-		pref_len[5] = 6;
-		pref_len[6] = 7;
-
-		if (type == 0) {
-			data_len[0] = 0;
-			data_len[1] = 1;
-			data_len[2] = 2;
-			data_len[3] = 3;
-			data_len[4] = 4;
-			data_len[5] = 10;
-			data_len[6] = 25;
-		} else if (type == 1) {
-			data_len[0] = 0;
-			data_len[1] = 0;
-			data_len[2] = 1;
-			data_len[3] = 2;
-			data_len[4] = 4;
-			data_len[5] = 10;
-			data_len[6] = 25;
-		} else if (type == 2) {
-			data_len[0] = 1;
-			data_len[1] = 2;
-			data_len[2] = 3;
-			data_len[3] = 4;
-			data_len[4] = 5;
-			data_len[5] = 10;
-			data_len[6] = 25;
-		} else if (type == 3) {
-			data_len[0] = 1;
-			data_len[1] = 3;
-			data_len[2] = 5;
-			data_len[3] = 7;
-			data_len[4] = 9;
-			data_len[5] = 11;
-			data_len[6] = 25;
-		} else if (type == 4) {
-			data_len[0] = 2;
-			data_len[1] = 3;
-			data_len[2] = 4;
-			data_len[3] = 5;
-			data_len[4] = 6;
-			data_len[5] = 7;
-			data_len[6] = 25;
-		} else if (type == 5) {
-			data_len[0] = 1;
-			data_len[1] = 4;
-			data_len[2] = 5;
-			data_len[3] = 6;
-			data_len[4] = 7;
-			data_len[5] = 8;
-			data_len[6] = 25;
-		}
+void encodeChannel(const cv::Mat & img, bool gray, cv::Mat & result) {
 
-		int last = 0;
-		for (int i = 0; i < 7; ++i) {
-			int range = 1 << data_len[i];
-			data_msk[i] = (1 << data_len[i]) - 1;
-			data_min[i] = last+1;
-			data_max[i] = last + range;
-			last = data_max[i];
-			//std::cout << data_min[i] << "-" << data_max[i] << std::endl;
-		}
+	if (img.channels() != 1) {
+		std::cout << "encodeChannel: img must be one channel!\n";
+		result.release();
+		return;
 	}
 
-	int prefixes[7];
-	int pref_msk[7];
-	int pref_res[7];
-	int pref_len[7];
-	int data_len[7];
-	int data_msk[7];
-	int data_min[7];
-	int data_max[7];
+	result.create(img.size(), img.type());
 
-	int INTERVALS;
+	if (img.depth() == CV_16U)
+		encodeRows<uint16_t>(img, result, gray);
+	else
+		encodeRows<uchar>(img, result, gray);
+}
 
-	int getType() {
-		return m_type;
-	}
+template <typename T>
+static void predictRows(const cv::Mat & img, cv::Mat & result, T left_mask, T up_mask, T maj_mask) {
+	cv::Size size = img.size();
+	if (size.width == 0 || size.height == 0)
+		return;
 
-private:
-	int m_type;
-};
+	// the first row is predicted from cleared one above
+	const T* img_p = img.ptr <T> (0);
+	T* res_p = result.ptr <T> (0);
+	res_p[0] = img_p[0] ^ predict<T>(0, 0, 0, left_mask, up_mask, maj_mask);
+	for (int x = 1; x < size.width; ++x)
+		res_p[x] = img_p[x] ^ predict<T>(img_p[x-1], 0, 0, left_mask, up_mask, maj_mask);
 
-class RleBuffer {
-public:
-	RleBuffer(RleCodebook cb = RleCodebook(0), int w = 0, int h = 0) : m_tmp(0), m_tmp_size(0), m_read_pos(0), m_read_buf(0), m_read_size(0), codebook(cb) {
-		m_header.width = w;
-		m_header.height = h;
-		m_header.type = cb.getType();
-	}
+	for (int y = 1; y < size.height; ++y) {
 
-	void setFirstSymbol(uint8_t s) {
-		m_header.first_symbol = s;
-	}
+		const T* img_p = img.ptr <T> (y);
+		const T* up_p = img.ptr <T> (y-1);
+		T* res_p = result.ptr <T> (y);
 
-	uint8_t getFirstSymbol() {
-		return m_header.first_symbol;
-	}
+		res_p[0] = img_p[0] ^ predict<T>(0, up_p[0], 0, left_mask, up_mask, maj_mask);
 
-	uint16_t getWidth() {
-		return m_header.width;
+		for (int x = 1; x < size.width; ++x)
+			res_p[x] = img_p[x] ^ predict<T>(img_p[x-1], up_p[x], up_p[x-1], left_mask, up_mask, maj_mask);
 	}
+}
 
-	uint16_t getHeight() {
-		return m_header.height;
-	}
+/*!
+ * Residual of coded channel, plane p predicted with predictors[p]. Replaces
+ * en_xor() for all planes at once.
+ */
+cv::Mat predictChannel(const cv::Mat & img, const std::vector<int> & predictors) {
+	cv::Mat result;
+	predictChannel(img, predictors, result);
+	return result;
+}
 
-	void saveToFile(const std::string & filename) {
-		std::ofstream f(filename.c_str(), std::ios_base::out | std::ios_base::binary);
-		saveToFile(f);
-	}
+void predictChannel(const cv::Mat & img, const std::vector<int> & predictors, cv::Mat & result) {
 
-	void loadFromFile(const std::string & filename) {
-		std::ifstream f(filename.c_str(), std::ios_base::in | std::ios_base::binary);
-		loadFromFile(f);
+	if (img.channels() != 1) {
+		std::cout << "predictChannel: img must be one channel!\n";
+		result.release();
+		return;
 	}
 
-	void saveToFile(std::ofstream & f) {
-		uint32_t tmp = m_buffer.size();
-		f.write((char*)&(m_header.first_symbol), 2);
-		f.write((char*)&(m_header.width), 4);
-		f.write((char*)&(m_header.height), 4);
-		f.write((char*)&(m_header.type), 2);
-		f.write((char*)&tmp, 4);
-		f.write((char*)&(m_buffer[0]), sizeof(uint32_t) * m_buffer.size());
-	}
+	int left_mask, up_mask, maj_mask;
+	predictorMasks(predictors, left_mask, up_mask, maj_mask);
 
-	void loadFromFile(std::ifstream & f) {
-		uint32_t tmp;
-		f.read((char*)&(m_header.first_symbol), 2);
-		f.read((char*)&(m_header.width), 4);
-		f.read((char*)&(m_header.height), 4);
-		f.read((char*)&(m_header.type), 2);
-		f.read((char*)&tmp, 4);
-		m_buffer.resize(tmp);
-		f.read((char*)&(m_buffer[0]), sizeof(uint32_t) * m_buffer.size());
-		codebook = RleCodebook(m_header.type);
-	}
+	result.create(img.size(), img.type());
 
-	int getNextLength() {
-		fillRead();
+	if (img.depth() == CV_16U)
+		predictRows<uint16_t>(img, result, left_mask, up_mask, maj_mask);
+	else
+		predictRows<uchar>(img, result, left_mask, up_mask, maj_mask);
+}
 
+template <typename T>
+static void mergeRows(const std::vector<PackedPlane> & planes, int lowest, bool gray, cv::Mat & result);
 
-		uint8_t tmp = (m_read_buf >> 56);
-		uint32_t data = m_read_buf >> 32;
+/*!
+ * 8 pixels at a time, each plane contributing one byte of bits spread over them.
+ */
+template <>
+void mergeRows<uchar>(const std::vector<PackedPlane> & planes, int lowest, bool gray, cv::Mat & result) {
+	cv::Size size = result.size();
 
-		//std::cout << binary(m_read_buf) << " " << binary(tmp) << " " << binary(data) << " " << m_read_pos << std::endl;
+	for (int y = 0; y < size.height; ++y) {
 
-		for (int i = 0; i < codebook.INTERVALS; ++i) {
-			uint8_t r = tmp & codebook.pref_msk[i];
-			//std::cout << binary(r) << std::endl;
-			if ((tmp & codebook.pref_msk[i]) == codebook.pref_res[i]) {
-				data >>= (32 - codebook.data_len[i] - codebook.pref_len[i]);
-				data &= codebook.data_msk[i];
-				data += codebook.data_min[i];
+		const uint64_t* img_p[8];
+		for (int i = lowest; i < planes.size(); ++i)
+			img_p[i] = planes[i].row(y);
 
-				m_read_buf <<= codebook.data_len[i] + codebook.pref_len[i];
-				m_read_size -= codebook.data_len[i] + codebook.pref_len[i];
+		uchar* res_p = result.ptr <uchar> (y);
 
-				//std::cout << "Got: " << data << std::endl;
+		for (int x = 0; x < size.width; x += 8) {
+			uint64_t val = 0;
+			for (int i = lowest; i < planes.size(); ++i)
+				val |= spread_table.v[(img_p[i][x >> 6] >> (x & 63)) & 0xFF] << i;
 
-				return data;
-			}
+			int n = std::min(8, size.width - x);
+			for (int k = 0; k < n; ++k)
+				res_p[x + k] = (uchar)(val >> (8 * k));
 		}
-		return 0;
+
+		if (gray)
+			graydecodeRow(res_p, res_p, size.width);
 	}
+}
 
-	RleBuffer & add(int len) {
-		int i;
+/*!
+ * 8 pixels at a time as two words of 4 16-bit lanes, each plane contributing
+ * a nibble of bits to each word.
+ */
+template <>
+void mergeRows<uint16_t>(const std::vector<PackedPlane> & planes, int lowest, bool gray, cv::Mat & result) {
+	cv::Size size = result.size();
 
-		for (i = 0; i < codebook.INTERVALS; ++i) {
-			if (len <= codebook.data_max[i]) {
-				addSymbol(codebook.prefixes[i], codebook.pref_len[i]);
-				addSymbol(len - codebook.data_min[i], codebook.data_len[i]);
-				//printf("0x%02x %d %d %d\n", prefixes[i], pref_len[i], len, data_len[i]);
-				break;
-			}
-		}
+	for (int y = 0; y < size.height; ++y) {
 
-		if (i >= codebook.INTERVALS) {
-			//std::cout << "Block too big!";
-		}
+		const uint64_t* img_p[MAX_DEPTH];
+		for (int i = lowest; i < planes.size(); ++i)
+			img_p[i] = planes[i].row(y);
 
-		return *this;
-	}
+		uint16_t* res_p = result.ptr <uint16_t> (y);
 
-	int size() {
-		return m_buffer.size() * 4;
-	}
+		for (int x = 0; x < size.width; x += 8) {
+			uint64_t lo = 0;
+			uint64_t hi = 0;
+			for (int i = lowest; i < planes.size(); ++i) {
+				int bits = (img_p[i][x >> 6] >> (x & 63)) & 0xFF;
+				lo |= spread_table16.v[bits & 0x0F] << i;
+				hi |= spread_table16.v[bits >> 4] << i;
+			}
 
-	void finish() {
-		if (m_tmp_size > 0) {
-			addSymbol(0, 32-m_tmp_size);
+			int n = std::min(8, size.width - x);
+			for (int k = 0; k < n; ++k)
+				res_p[x + k] = (uint16_t)((k < 4 ? lo : hi) >> (16 * (k & 3)));
 		}
-	}
 
-protected:
-	void addSymbol(int symb, int len) {
-		if (len < 1)
-			return;
-
-		//std::cout << "B: " << m_tmp << " " << m_tmp_size << std::endl;
-		m_tmp_size += len;
-		m_tmp <<= len;
-		m_tmp |= symb;
-		//std::cout << "A: " << m_tmp << " " << m_tmp_size << std::endl;
-		reduce();
-	}
-
-	void reduce() {
-		uint32_t tmp;
-		uint64_t old = m_tmp;
-		int tail = m_tmp_size - 32;
-		if (tail >= 0) {
-			old >>= tail;
-			tmp = old & 0xFFFFFFFF;
-			m_buffer.push_back(tmp);
-			m_tmp_size -= 32;
-			//std::cout << "Inserted: " << binary(tmp) << std::endl;
-		}
+		if (gray)
+			graydecodeRow(res_p, res_p, size.width);
 	}
+}
 
-	void fillRead() {
-		uint64_t tmp;
-		if ( (m_read_size < 32) && (m_read_pos < m_buffer.size())) {
-			tmp = m_buffer[m_read_pos];
-			//std::cout << "From buffer: " << binary(tmp) << std::endl;
-
-			tmp <<= (32 - m_read_size);
-			m_read_buf |= tmp;
+template <typename T>
+static void fillRows(cv::Mat & result, int lowest) {
+	T keep_mask = (T)(0xFFFFu << lowest);
+	T fill = (T)1 << (lowest - 1);
+	cv::Size size = result.size();
 
-			m_read_pos++;
-			m_read_size += 32;
-		}
+	for (int y = 0; y < size.height; ++y) {
+		T* res_p = result.ptr <T> (y);
+		for (int x = 0; x < size.width; ++x)
+			res_p[x] = (res_p[x] & keep_mask) | fill;
 	}
+}
 
-private:
-	std::vector<uint32_t> m_buffer;
-	uint64_t m_tmp;
-	uint32_t m_tmp_size;
-
-	size_t m_read_pos;
-	uint64_t m_read_buf;
-	uint64_t m_read_size;
+/*!
+ * Inverse of encodeChannel(): merges packed bit planes (already unpredicted)
+ * and undoes Gray coding in a single pass over the channel. Number of planes
+ * is the channel depth, result is 8-bit for up to 8 planes, 16-bit for more.
+ *
+ * Only \a kept most significant planes are used (the rest may be empty), lower
+ * bits are set to midpoint of their range. Top bits of Gray code depend only on
+ * top bits of the value, so this is done after Gray decoding.
+ */
+cv::Mat decodeChannel(const std::vector<PackedPlane> & planes, bool gray, int kept) {
+	cv::Mat result;
+	decodeChannel(planes, gray, kept, result);
+	return result;
+}
 
-	RLEHeader m_header;
+void decodeChannel(const std::vector<PackedPlane> & planes, bool gray, int kept, cv::Mat & result) {
+	int depth = planes.size();
+	if (depth < 1 || depth > MAX_DEPTH || kept < 1 || kept > depth) {
+		std::cout << "decodeChannel: must be 1 <= planes.size() <= " << MAX_DEPTH
+				<< " and 1 <= kept <= planes.size()!\n";
+		result.release();
+		return;
+	}
 
-	RleCodebook codebook;
-};
+	int lowest = depth - kept;
+	const PackedPlane & top = planes[depth - 1];
+	result.create(top.height, top.width, depth > 8 ? CV_16UC1 : CV_8UC1);
 
-cv::Mat rle(RleBuffer & buf) {
-	cv::Mat img = cv::Mat::zeros(buf.getHeight(), buf.getWidth(), CV_8UC1);
+	if (depth > 8)
+		mergeRows<uint16_t>(planes, lowest, gray, result);
+	else
+		mergeRows<uchar>(planes, lowest, gray, result);
 
-	cv::Size size = img.size();
-	uint32_t ctr = 0;
-	uchar current_symbol = buf.getFirstSymbol();
+	if (lowest > 0) {
+		if (depth > 8)
+			fillRows<uint16_t>(result, lowest);
+		else
+			fillRows<uchar>(result, lowest);
+	}
+}
 
-	if (img.isContinuous()) {
-		size.width *= size.height;
-		size.height = 1;
+// ===============================================================================================
+//
+// RLE
+//
+// ===============================================================================================
+
+template <typename T>
+static std::string binary(T i)
+{
+	std::string result;
+	for (int bit = 0; bit < sizeof(T)*8; ++bit) {
+		result = (char)((i & 1) + '0') + result;
+		i >>= 1;
+	}
+	return result;
+}
+
+/*!
+ * Decodes RLE stream into bit plane image (pixels are 0 or 255). Every pixel is
+ * written by exactly one run, so the image is not cleared first and each run
+ * is a single memset(). Returns empty image if the stream doesn't cover the
+ * plane exactly.
+ */
+cv::Mat rle(RleBuffer & buf) {
+	cv::Mat img(buf.getHeight(), buf.getWidth(), CV_8UC1);
+
+	if (buf.getMode() == PLANE_RAW || buf.getMode() == PLANE_READ) {
+		PackedPlane plane;
+		if (buf.getMode() == PLANE_RAW ? !buf.getRaw(plane) : rle(buf, plane) < 0)
+			return cv::Mat();
+		for (int y = 0; y < plane.height; ++y) {
+			const uint64_t* p = plane.row(y);
+			uchar* img_p = img.ptr <uchar> (y);
+			for (int x = 0; x < plane.width; ++x)
+				img_p[x] = (p[x >> 6] >> (x & 63)) & 1 ? 255 : 0;
+		}
+		return img;
 	}
 
-	for (int y = 0; y < size.height; ++y) {
+	uchar current_symbol = buf.getFirstSymbol();
+	uchar* img_p = img.ptr <uchar> (0);
+	size_t total = (size_t)img.size().width * img.size().height;
 
-		uchar* img_p = img.ptr <uchar> (y);
+	for (size_t x = 0; x < total; ) {
+		size_t ctr = buf.getNextLength();
 
-		for (int x = 0; x < size.width; ++x) {
-			ctr = buf.getNextLength();
-			for (int i = 0; i < ctr; ++i)
-				img_p[x+i] = current_symbol;
+		if (ctr == 0 || ctr > total - x)
+			return cv::Mat();
 
-			current_symbol = 255 - current_symbol;
-			x += ctr-1;
-		}
+		memset(img_p + x, current_symbol, ctr);
+
+		current_symbol = 255 - current_symbol;
+		x += ctr;
 	}
 
 	return img;
 }
 
-RleBuffer rle(const cv::Mat & img, int type = 0) {
-
-	if (img.channels() != 1) {
-		std::cout << "rle: img must be one channel!\n";
-		return RleBuffer(0, 0);
+/*!
+ * Sets bits [x, x + n) of packed row, whole words are filled at once.
+ */
+static inline void setBits(uint64_t * row, int x, int n) {
+	int end = x + n - 1;
+	int w = x >> 6;
+	int last = end >> 6;
+	uint64_t head = ~(uint64_t)0 << (x & 63);
+	uint64_t tail = ~(uint64_t)0 >> (63 - (end & 63));
+
+	if (w == last) {
+		row[w] |= head & tail;
+		return;
 	}
 
-	RleBuffer result(RleCodebook(type), img.size().width, img.size().height);
+	row[w] |= head;
+	std::fill(row + w + 1, row + last, ~(uint64_t)0);
+	row[last] |= tail;
+}
 
-	cv::Size size = img.size();
-	uint32_t ctr = 0;
-	uchar current_symbol = 128;
+/*!
+ * Moves \a b to b1 of READ coding: the first change in reference row right of
+ * \a a0 to colour other than \a color. Changes at even indices are to set bits.
+ */
+static inline int findB1(const int * ref, int b, int a0, int color) {
+	// vertical modes may move a0 back before the last b1
+	while (b > 0 && ref[b - 1] > a0)
+		--b;
+	while (ref[b] <= a0 || (b & 1) != color)
+		++b;
+	return b;
+}
 
-	if (img.isContinuous()) {
-		size.width *= size.height;
-		size.height = 1;
+/*!
+ * Stores positions of changes in packed row (pixels differing from the left
+ * one, left of the row is cleared pixel) in \a changes, followed by 3 copies
+ * of the width, so that b1 and b2 of both colours are always found. There is
+ * room for width + 3 of them.
+ */
+static void rowChanges(const uint64_t * row, int width, int * changes) {
+	int words = (width + 63) / 64;
+	uint64_t carry = 0;
+	for (int w = 0; w < words; ++w) {
+		uint64_t bits = row[w];
+		if (w == words - 1 && (width & 63))
+			bits &= ~(uint64_t)0 >> (64 - (width & 63));
+
+		uint64_t diff = bits ^ (bits << 1 | carry);
+		carry = bits >> 63;
+		while (diff) {
+			int x = w * 64 + __builtin_ctzll(diff);
+			if (x < width)
+				*changes++ = x;
+			diff &= diff - 1;
+		}
 	}
+	changes[0] = changes[1] = changes[2] = width;
+}
 
-	for (int y = 0; y < size.height; ++y) {
+/*!
+ * Finds READ codes of packed \a plane and passes them to sink.addMode(), run
+ * lengths of horizontal mode (plus one, they may be empty) to sink.add().
+ * Change lists of the current and previous row are kept in \a changes.
+ */
+template <typename Sink>
+static void scanRead(const PackedPlane & plane, Sink & sink, std::vector<int> & changes) {
+	changes.assign(2 * (plane.width + 3), plane.width);
+	int * ref = changes.data();
+	int * cur = ref + plane.width + 3;
+
+	for (int y = 0; y < plane.height; ++y) {
+		rowChanges(plane.row(y), plane.width, cur);
+
+		int a0 = -1;
+		int color = 0;
+		int a = 0;
+		int b = 0;
+		while (a0 < plane.width) {
+			while (cur[a] <= a0)
+				++a;
+			int a1 = cur[a];
+			int a2 = cur[a + 1];
+
+			b = findB1(ref, b, a0, color);
+			int b1 = ref[b];
+			int b2 = ref[b + 1];
+
+			if (b2 < a1) {
+				sink.addMode(READ_PASS);
+				a0 = b2;
+			} else if (a1 - b1 >= -3 && a1 - b1 <= 3) {
+				sink.addMode(READ_V0 + a1 - b1);
+				a0 = a1;
+				color ^= 1;
+			} else {
+				sink.addMode(READ_HORIZONTAL);
+				sink.add(a1 - std::max(a0, 0) + 1);
+				sink.add(a2 - a1 + 1);
+				a0 = a2;
+			}
+		}
 
-		const uchar* img_p = img.ptr <uchar> (y);
+		std::swap(ref, cur);
+	}
+}
 
-		for (int x = 0; x < size.width; ++x) {
-			if (current_symbol == 128) {
-				current_symbol = img_p[x];
-				result.setFirstSymbol(current_symbol);
+/*!
+ * Decodes PLANE_READ stream into packed bit plane, row by row. Returns number
+ * of decoded codes, -1 if the stream ends early or holds changes out of order.
+ */
+static int readPlane(RleBuffer & buf, PackedPlane & plane, std::vector<int> & changes) {
+	changes.assign(2 * (plane.width + 3), plane.width);
+	int * ref = changes.data();
+	int * cur = ref + plane.width + 3;
+	int codes = 0;
+
+	for (int y = 0; y < plane.height; ++y) {
+		int n = 0;
+		int a0 = -1;
+		int color = 0;
+		int b = 0;
+		while (a0 < plane.width) {
+			b = findB1(ref, b, a0, color);
+			int mode = buf.getNextMode();
+			++codes;
+
+			if (mode < 0) {
+				return -1;
+			} else if (mode == READ_PASS) {
+				a0 = ref[b + 1];
+			} else if (mode == READ_HORIZONTAL) {
+				// runs are coded plus one, empty run only starts the row or ends it
+				int run1 = buf.getNextLength() - 1;
+				int run2 = buf.getNextLength() - 1;
+				int a1 = std::max(a0, 0) + run1;
+				int a2 = a1 + run2;
+				if (run1 < 0 || run2 < 0 || (run1 == 0 && a0 >= 0) || (run2 == 0 && a2 < plane.width) || a2 > plane.width)
+					return -1;
+				if (a1 < plane.width)
+					cur[n++] = a1;
+				if (a2 < plane.width)
+					cur[n++] = a2;
+				a0 = a2;
+			} else {
+				int a1 = ref[b] + mode - READ_V0;
+				if (a1 <= a0 || a1 > plane.width)
+					return -1;
+				if (a1 < plane.width)
+					cur[n++] = a1;
+				a0 = a1;
+				color ^= 1;
 			}
+		}
 
-			if (img_p[x] != current_symbol) {
-				result.add(ctr);
-				ctr = 1;
-				current_symbol = 255-current_symbol;
-			} else {
-				ctr++;
+		uint64_t * row = plane.row(y);
+		for (int i = 0; i < n; i += 2)
+			setBits(row, cur[i], (i + 1 < n ? cur[i + 1] : plane.width) - cur[i]);
+
+		cur[n] = cur[n + 1] = cur[n + 2] = plane.width;
+		std::swap(ref, cur);
+	}
+
+	return codes;
+}
+
+/*!
+ * Decodes RLE stream straight into packed bit plane. Runs continue across rows
+ * and are split at row ends, only runs of set bits touch the (cleared) plane.
+ * PLANE_READ streams are decoded row by row. Returns number of decoded runs
+ * (codes), -1 if the stream ends early or overruns the plane.
+ */
+int rle(RleBuffer & buf, PackedPlane & plane) {
+	std::vector<int> changes;
+	return rle(buf, plane, changes);
+}
+
+int rle(RleBuffer & buf, PackedPlane & plane, std::vector<int> & changes) {
+	plane.reset(buf.getWidth(), buf.getHeight());
+
+	if (buf.getMode() == PLANE_READ)
+		return readPlane(buf, plane, changes);
+
+	if (plane.width == 0)
+		return 0;
+
+	uchar current_symbol = buf.getFirstSymbol();
+	int x = 0;
+	int y = 0;
+	int runs = 0;
+	int64_t remaining = (int64_t)plane.width * plane.height;
+
+	while (y < plane.height) {
+		int ctr = buf.getNextLength();
+
+		if (ctr <= 0 || ctr > remaining)
+			return -1;
+
+		remaining -= ctr;
+		++runs;
+
+		while (ctr > 0) {
+			int n = std::min(ctr, plane.width - x);
+			if (current_symbol)
+				setBits(plane.row(y), x, n);
+
+			x += n;
+			ctr -= n;
+			if (x == plane.width) {
+				x = 0;
+				++y;
 			}
 		}
 
-		result.add(ctr);
+		current_symbol = 255 - current_symbol;
+	}
+
+	return runs;
+}
+
+/*!
+ * Run-length encodes bit plane \a plane of \a img, runs are found in the plane
+ * packed first.
+ */
+RleBuffer rle(const cv::Mat & img, int plane, int type) {
+	return rle(img, plane, RleCodebook(type));
+}
+
+RleBuffer rle(const cv::Mat & img, int plane, const RleCodebook & cb) {
+	RleBuffer result;
+	rle(img, plane, cb, result);
+	return result;
+}
+
+void rle(const cv::Mat & img, int plane, const RleCodebook & cb, RleBuffer & result) {
+
+	if (img.channels() != 1) {
+		std::cout << "rle: img must be one channel!\n";
+		result.reset(RleCodebook(0), 0, 0);
+		return;
 	}
 
+	result.reset(cb, img.size().width, img.size().height);
+	// runs aren't counted beforehand, so room is made for the worst ones
+	result.reserve(RleBuffer::maxSize(cb, img.size().width, img.size().height));
+
+	PackedPlane packed;
+	packPlane(img, plane, packed);
+	result.setFirstSymbol(scanRuns(packed, result));
 	result.finish();
 
+	if (result.failed())
+		std::cout << "rle: runs too long for the codebook!\n";
+
 	//std::cout << "Uncompressed size: " << (img.size().width * img.size().height) / 8 << std::endl;
 	//std::cout << "Compressed size:   " << result.size() << std::endl;
+}
+
+/*!
+ * Run-length encodes single bit plane image (pixels are 0 or 255).
+ */
+RleBuffer rle(const cv::Mat & img, int type) {
+	return rle(img, 7, type);
+}
+
+/*
+ * Shortest path over (interval, last run length covered by it): each of the
+ * first six intervals ends below LIMIT, the one coding the longest run covers
+ * everything left and the intervals after it stay empty.
+ */
+RleCodebook RunHistogram::fit(int & bytes) {
+	const int64_t INF = std::numeric_limits<int64_t>::max();
+	const int MAX_STEP = 12;
+	// last run length an interval other than the last one may end at
+	const int reach = longest < LIMIT ? longest : (int)LIMIT;
+
+	// runs up to given length, all longer ones are counted in total
+	std::vector<int64_t> & below = fit_below;
+	below.assign(LIMIT, 0);
+	for (int len = 1; len < LIMIT; ++len)
+		below[len] = below[len - 1] + counts[len];
+	int64_t total = below[LIMIT - 1] + counts[LIMIT];
+
+	std::vector<int64_t> & cost = fit_cost;
+	std::vector<int64_t> & next = fit_next;
+	std::vector<uint8_t> & step = fit_step;
+	cost.assign(LIMIT, INF);
+	next.assign(LIMIT, INF);
+	step.assign(6 * LIMIT, 0);
+	cost[0] = 0;
+
+	int64_t best_bits = INF;
+	int best_interval = 0, best_last = 0, best_len = 0;
+
+	for (int i = 0; i < 7; ++i) {
+		int pref_len = i + 1;
+		std::fill(next.begin(), next.end(), INF);
+
+		for (int last = 0; last < LIMIT; ++last) {
+			if (cost[last] == INF)
+				continue;
+
+			int len = 0;
+			while (last + (1 << len) < longest && len < RleCodebook::MAX_DATA_LEN)
+				++len;
+			int64_t bits = cost[last] + (int64_t)(pref_len + len) * (total - below[last]);
+			if (last + (1 << len) >= longest && bits < best_bits) {
+				best_bits = bits;
+				best_interval = i;
+				best_last = last;
+				best_len = len;
+			}
+
+			if (i == 6)
+				continue;
+
+			// intervals reaching the longest run are tried as the last one above
+			for (int d = 0; d <= MAX_STEP && last + (1 << d) < reach; ++d) {
+				int end = last + (1 << d);
+				int64_t c = cost[last] + (int64_t)(pref_len + d) * (below[end] - below[last]);
+				if (c < next[end]) {
+					next[end] = c;
+					step[i * LIMIT + end] = d;
+				}
+			}
+		}
+
+		cost.swap(next);
+	}
+
+	int lengths[7] = {0};
+	if (best_bits == INF) {
+		// runs longer than any codebook can code
+		bytes = -1;
+		return RleCodebook(lengths);
+	}
+
+	lengths[best_interval] = best_len;
+	for (int i = best_interval - 1, last = best_last; i >= 0; --i) {
+		lengths[i] = step[i * LIMIT + last];
+		last -= 1 << lengths[i];
+	}
+
+	bytes = ((best_bits + 31) / 32) * 4;
+	return RleCodebook(lengths);
+}
+
+RleCodebook RunHistogram::fixed(int & bytes) const {
+	RleCodebook cb(0);
+	bytes = -1;
+	for (int type = 0; type < 6; ++type) {
+		int sz = size(RleCodebook(type));
+		if (sz >= 0 && (bytes < 0 || sz < bytes)) {
+			bytes = sz;
+			cb = RleCodebook(type);
+		}
+	}
+	return cb;
+}
+
+RleCodebook RunHistogram::best(int & bytes) {
+	RleCodebook cb = fixed(bytes);
+	if (runs < FIT_MIN_RUNS)
+		return cb;
+
+	int sz;
+	RleCodebook fitted = fit(sz);
+	// interval lengths are stored in the record
+	if (sz >= 0 && (bytes < 0 || sz + 7 < bytes)) {
+		bytes = sz + 7;
+		cb = fitted;
+	}
+	return cb;
+}
+
+void RunCode::build(const uint32_t * counts) {
+	typedef std::pair<uint64_t, int> Node;
+	std::greater<Node> later;
+	uint64_t weights[RUN_CLASSES];
+	std::copy(counts, counts + RUN_CLASSES, weights);
+
+	for (;;) {
+		// min-heap of subtrees, merging never makes more of them than there are classes
+		Node heap[RUN_CLASSES];
+		int nodes = 0;
+		for (int c = 0; c < RUN_CLASSES; ++c)
+			if (weights[c]) {
+				heap[nodes++] = Node(weights[c], c);
+				std::push_heap(heap, heap + nodes, later);
+			}
+
+		std::fill(lengths, lengths + RUN_CLASSES, 0);
+		if (nodes == 1)
+			lengths[heap[0].second] = 1;
+		if (nodes <= 1)
+			break;
+
+		// nodes past RUN_CLASSES are inner ones, lengths are depths of leaves
+		int parent[2 * RUN_CLASSES];
+		std::fill(parent, parent + 2 * RUN_CLASSES, -1);
+		int next = RUN_CLASSES;
+		while (nodes > 1) {
+			std::pop_heap(heap, heap + nodes--, later);
+			Node a = heap[nodes];
+			std::pop_heap(heap, heap + nodes--, later);
+			Node b = heap[nodes];
+			parent[a.second] = next;
+			parent[b.second] = next;
+			heap[nodes++] = Node(a.first + b.first, next++);
+			std::push_heap(heap, heap + nodes, later);
+		}
+
+		int longest = 0;
+		for (int c = 0; c < RUN_CLASSES; ++c) {
+			if (!weights[c])
+				continue;
+			int depth = 0;
+			for (int n = c; parent[n] >= 0; n = parent[n])
+				++depth;
+			lengths[c] = std::min(depth, 15);
+			longest = std::max(longest, depth);
+		}
+
+		if (longest <= MAX_LENGTH)
+			break;
+
+		// flatten the distribution until the code fits
+		for (int c = 0; c < RUN_CLASSES; ++c)
+			if (weights[c])
+				weights[c] = (weights[c] >> 1) | 1;
+	}
+
+	assign();
+}
+
+bool RunCode::assign() {
+	int count[MAX_LENGTH + 1] = {0};
+	for (int c = 0; c < RUN_CLASSES; ++c) {
+		if (lengths[c] > MAX_LENGTH)
+			return false;
+		count[lengths[c]]++;
+	}
+
+	// no length may be used more often than the shorter ones leave room for
+	int left = 1;
+	for (int len = 1; len <= MAX_LENGTH; ++len) {
+		left <<= 1;
+		left -= count[len];
+		if (left < 0)
+			return false;
+	}
+
+	int next[MAX_LENGTH + 1];
+	int code = 0;
+	count[0] = 0;
+	for (int len = 1; len <= MAX_LENGTH; ++len) {
+		code = (code + count[len - 1]) << 1;
+		next[len] = code;
+	}
+
+	for (int c = 0; c < RUN_CLASSES; ++c)
+		codes[c] = lengths[c] ? next[lengths[c]]++ : 0;
+
+	return true;
+}
+
+void RunCode::buildTable() {
+	table.assign(1 << MAX_LENGTH, 0);
+	for (int c = 0; c < RUN_CLASSES; ++c) {
+		if (!lengths[c])
+			continue;
+		int shift = MAX_LENGTH - lengths[c];
+		std::fill(table.begin() + (codes[c] << shift), table.begin() + ((codes[c] + 1) << shift), c << 4 | lengths[c]);
+	}
+}
+
+int RunClassHistogram::size(RunCode * codes) const {
+	int64_t bits = 0;
+	for (int k = 0; k < 2; ++k) {
+		codes[k].build(counts[k]);
+		bits += codes[k].tableBits();
+		for (int c = 0; c < RUN_CLASSES; ++c)
+			if (counts[k][c])
+				bits += (int64_t)counts[k][c] * (codes[k].lengths[c] + runExtraBits(c));
+	}
+	return ((bits + 31) / 32) * 4;
+}
+
+RleBuffer rleClasses(const cv::Mat & img, int plane) {
+	RleBuffer result;
+	rleClasses(img, plane, result);
+	return result;
+}
+
+/*!
+ * Codes \a runs of \a width x \a height plane in PLANE_HUFFMAN mode with codes
+ * built for them into \a result, the stream is \a bytes long.
+ */
+static void classesCode(const PlaneRuns & runs, int bytes, int width, int height, RleBuffer & result) {
+	result.reset(RleCodebook(0), width, height);
+	result.reserve(bytes);
+	result.setRunCodes(runs.codes[0], runs.codes[1]);
+	result.setFirstSymbol(runs.first_symbol);
+	runs.replay(result);
+	result.finish();
+}
+
+void rleClasses(const cv::Mat & img, int plane, RleBuffer & result) {
+	PackedPlane packed;
+	packPlane(img, plane, packed);
+	PlaneRuns runs;
+	runs.first_symbol = scanRuns(packed, runs);
+	int bytes = runs.classes.size(runs.codes);
+	classesCode(runs, bytes, packed.width, packed.height, result);
+}
+
+/*!
+ * Codes counted \a read codes of \a width x \a height plane in PLANE_READ mode
+ * with codebook \a cb into \a result, the stream is \a bytes long, as
+ * ReadHistogram::size() counted it.
+ */
+static void readCode(const ReadHistogram & read, const RleCodebook & cb, int bytes, int width, int height, RleBuffer & result) {
+	result.reset(cb, width, height);
+	result.reserve(bytes);
+	result.setRead();
+	read.replay(result);
+	result.finish();
+}
 
+RleBuffer rleRead(const cv::Mat & img, int plane) {
+	PackedPlane packed = packPlane(img, plane);
+	std::vector<int> changes;
+
+	ReadHistogram hist;
+	scanRead(packed, hist, changes);
+	RleCodebook cb(0);
+	int bytes = hist.size(cb);
+	if (bytes < 0)
+		std::cout << "rleRead: runs too long for any codebook!\n";
+
+	RleBuffer result;
+	readCode(hist, cb, std::max(bytes, 0), packed.width, packed.height, result);
 	return result;
 }
 
@@ -607,86 +1463,569 @@ cv::Mat de_xor(const cv::Mat & img) {
 	return result;
 }
 
+/*!
+ * Prefix XOR of word bits, bit i of result is XOR of bits 0..i of \a v.
+ */
+static inline uint64_t prefixXor(uint64_t v) {
+	v ^= v << 1;
+	v ^= v << 2;
+	v ^= v << 4;
+	v ^= v << 8;
+	v ^= v << 16;
+	v ^= v << 32;
+	return v;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*!
+ * de_xor() with prefix XOR done by carry-less multiplication by all ones, in
+ * one instruction.
+ */
+__attribute__((target("pclmul")))
+static void deXorClmul(PackedPlane & plane) {
+	const __m128i ones = _mm_set1_epi64x(-1);
+	for (int y = 0; y < plane.height; ++y) {
+		uint64_t* p = plane.row(y);
+		uint64_t carry = 0;
+		for (int w = 0; w < plane.stride; ++w) {
+			__m128i r = _mm_clmulepi64_si128(_mm_cvtsi64_si128(p[w]), ones, 0);
+			uint64_t v = (uint64_t)_mm_cvtsi128_si64(r) ^ carry;
+			p[w] = v;
+			carry = (uint64_t)0 - (v >> 63);
+		}
+	}
+}
+#endif
+
+/*!
+ * Inverse of left neighbour prediction on packed plane, in place. Each row is
+ * a prefix XOR, computed 64 pixels at a time with the last bit of a word
+ * carried into the next one.
+ */
+void de_xor(PackedPlane & plane) {
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (has_pclmul) {
+		deXorClmul(plane);
+		return;
+	}
+#endif
+
+	for (int y = 0; y < plane.height; ++y) {
+		uint64_t* p = plane.row(y);
+		uint64_t carry = 0;
+		for (int w = 0; w < plane.stride; ++w) {
+			uint64_t v = prefixXor(p[w]) ^ carry;
+			p[w] = v;
+			carry = (uint64_t)0 - (v >> 63);
+		}
+	}
+}
+
+/*!
+ * Inverse of upper neighbour prediction on packed plane, in place.
+ */
+void de_xor_up(PackedPlane & plane) {
+	for (int y = 1; y < plane.height; ++y) {
+		uint64_t* p = plane.row(y);
+		const uint64_t* up = plane.row(y-1);
+		for (int w = 0; w < plane.stride; ++w)
+			p[w] ^= up[w];
+	}
+}
+
+/*!
+ * Inverse of majority prediction on packed plane, in place.
+ *
+ * Where upper and upper-left pixels agree they are the prediction, elsewhere
+ * the left pixel is, so the row is a prefix XOR restarting at every pixel with
+ * agreeing neighbours. This segmented scan is done with log-step shifts.
+ */
+void de_xor_majority(PackedPlane & plane) {
+	for (int y = 0; y < plane.height; ++y) {
+		uint64_t* p = plane.row(y);
+		// pixels above the first row are 0
+		const uint64_t* up = y > 0 ? plane.row(y-1) : NULL;
+		uint64_t carry = 0;
+		uint64_t up_carry = 0;
+
+		for (int w = 0; w < plane.stride; ++w) {
+			uint64_t u = up ? up[w] : 0;
+			uint64_t ul = (u << 1) | up_carry;
+			up_carry = u >> 63;
+
+			// segment starts, pixels with known prediction
+			uint64_t f = ~(u ^ ul);
+			uint64_t v = p[w] ^ (u & f);
+
+			for (int d = 1; d < 64; d <<= 1) {
+				v ^= (v << d) & ~f;
+				f |= f << d;
+			}
+
+			// pixels before the first segment start continue previous word
+			v ^= ~f & carry;
+			p[w] = v;
+			carry = (uint64_t)0 - (v >> 63);
+		}
+	}
+}
+
+/*!
+ * Undoes prediction of packed plane.
+ */
+void unpredict(PackedPlane & plane, int predictor) {
+	if (predictor == PRED_LEFT)
+		de_xor(plane);
+	else if (predictor == PRED_UP)
+		de_xor_up(plane);
+	else if (predictor == PRED_MAJORITY)
+		de_xor_majority(plane);
+}
+
 // ===============================================================================================
 //
 // Bayer split/merge
 //
 // ===============================================================================================
 
-std::vector<cv::Mat> bayerSplit(const cv::Mat & img) {
-	cv::Size size = img.size();
-	std::vector<cv::Mat> channels;
-	cv::Mat ch_r(img.size().height/2 + img.size().height%2, img.size().width/2 + img.size().width%2, CV_8UC1);
-	cv::Mat ch_g(img.size().height, img.size().width/2, CV_8UC1);
-	cv::Mat ch_b(img.size().height/2, img.size().width/2, CV_8UC1);
-	channels.push_back(ch_r);
-	channels.push_back(ch_g);
-	channels.push_back(ch_b);
+/*!
+ * Splits \a n pixels of \a src into pixels at even (\a even) and odd (\a odd)
+ * positions.
+ */
+static void deinterleaveRow(const uchar * src, uchar * even, uchar * odd, int n) {
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i lo8 = _mm_set1_epi16(0x00FF);
+	for (; x + 32 <= n; x += 32) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + x + 16));
+		_mm_storeu_si128((__m128i*)(even + x / 2), _mm_packus_epi16(_mm_and_si128(a, lo8), _mm_and_si128(b, lo8)));
+		_mm_storeu_si128((__m128i*)(odd + x / 2), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+	}
+#endif
+	for (; x + 1 < n; x += 2) {
+		even[x / 2] = src[x];
+		odd[x / 2] = src[x + 1];
+	}
+	if (x < n)
+		even[x / 2] = src[x];
+}
 
-	for (int y = 0; y < size.height; ++y) {
+static void deinterleaveRow(const uint16_t * src, uint16_t * even, uint16_t * odd, int n) {
+	int x = 0;
+#if defined(__SSE2__)
+	// order lanes of every half as even, odd, then gather the halves
+	for (; x + 16 <= n; x += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + x + 8));
+		a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0));
+		b = _mm_shufflehi_epi16(_mm_shufflelo_epi16(b, _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0));
+		a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+		b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i*)(even + x / 2), _mm_unpacklo_epi64(a, b));
+		_mm_storeu_si128((__m128i*)(odd + x / 2), _mm_unpackhi_epi64(a, b));
+	}
+#endif
+	for (; x + 1 < n; x += 2) {
+		even[x / 2] = src[x];
+		odd[x / 2] = src[x + 1];
+	}
+	if (x < n)
+		even[x / 2] = src[x];
+}
 
-		const uchar* img_p = img.ptr <uchar> (y);
-		uchar* img_r = ch_r.ptr <uchar> (y/2);
-		uchar* img_g = ch_g.ptr <uchar> (y);
-		uchar* img_b = ch_b.ptr <uchar> (y/2);
+/*!
+ * Inverse of deinterleaveRow().
+ */
+static void interleaveRow(const uchar * even, const uchar * odd, uchar * dst, int n) {
+	int x = 0;
+#if defined(__SSE2__)
+	for (; x + 32 <= n; x += 32) {
+		__m128i e = _mm_loadu_si128((const __m128i*)(even + x / 2));
+		__m128i o = _mm_loadu_si128((const __m128i*)(odd + x / 2));
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_unpacklo_epi8(e, o));
+		_mm_storeu_si128((__m128i*)(dst + x + 16), _mm_unpackhi_epi8(e, o));
+	}
+#endif
+	for (; x + 1 < n; x += 2) {
+		dst[x] = even[x / 2];
+		dst[x + 1] = odd[x / 2];
+	}
+	if (x < n)
+		dst[x] = even[x / 2];
+}
 
+static void interleaveRow(const uint16_t * even, const uint16_t * odd, uint16_t * dst, int n) {
+	int x = 0;
+#if defined(__SSE2__)
+	for (; x + 16 <= n; x += 16) {
+		__m128i e = _mm_loadu_si128((const __m128i*)(even + x / 2));
+		__m128i o = _mm_loadu_si128((const __m128i*)(odd + x / 2));
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_unpacklo_epi16(e, o));
+		_mm_storeu_si128((__m128i*)(dst + x + 8), _mm_unpackhi_epi16(e, o));
+	}
+#endif
+	for (; x + 1 < n; x += 2) {
+		dst[x] = even[x / 2];
+		dst[x + 1] = odd[x / 2];
+	}
+	if (x < n)
+		dst[x] = even[x / 2];
+}
 
-		for (int x = 0; x < size.width; ++x) {
-			if ( (y % 2) && (x % 2) )
-				img_b[x/2] = img_p[(3*x)+0];
-			else if ( (y % 2) || (x % 2) )
-				img_g[x/2] = img_p[(3*x)+1];
-			else
-				img_r[x/2] = img_p[(3*x)+2];
+#if defined(__x86_64__) && defined(__GNUC__)
+/*!
+ * Picks every 6th byte of \a base into \a dst, 8 at a time while loads stay
+ * within \a limit bytes. Returns number of bytes picked.
+ */
+__attribute__((target("ssse3")))
+static int gatherRowSsse3(const uchar * base, uchar * dst, int limit) {
+	int k = 0;
+	// 8 picked bytes are 6 bytes apart, spread over three 16 byte loads
+	static const struct GatherMasks {
+		GatherMasks() {
+			for (int j = 0; j < 3; ++j)
+				for (int i = 0; i < 16; ++i) {
+					int pos = 6 * i - 16 * j;
+					m[j][i] = (i < 8 && pos >= 0 && pos < 16) ? pos : 0x80;
+				}
 		}
+		uchar m[3][16];
+	} masks;
+
+	const __m128i m0 = _mm_loadu_si128((const __m128i*)masks.m[0]);
+	const __m128i m1 = _mm_loadu_si128((const __m128i*)masks.m[1]);
+	const __m128i m2 = _mm_loadu_si128((const __m128i*)masks.m[2]);
+	for (; 6 * k + 48 <= limit; k += 8) {
+		const uchar * p = base + 6 * k;
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), m0);
+		v = _mm_or_si128(v, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), m1));
+		v = _mm_or_si128(v, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), m2));
+		_mm_storel_epi64((__m128i*)(dst + k), v);
 	}
+	return k;
+}
+#endif
 
-	cv::imwrite("r.bmp", ch_r);
-	cv::imwrite("g.bmp", ch_g);
-	cv::imwrite("b.bmp", ch_b);
+/*!
+ * Picks component \a comp of every other pixel of BGR row, starting with
+ * pixel \a start: dst[k] = src[3 * (start + 2 * k) + comp] for pixels below \a n.
+ */
+static void gatherRow(const uchar * src, uchar * dst, int start, int comp, int n) {
+	int count = (n - start + 1) / 2;
+	const uchar * base = src + 3 * start + comp;
+	int k = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (has_ssse3) {
+		// bytes of the row left from base, loads must stay within them
+		int limit = 3 * n - 3 * start - comp;
+		k = gatherRowSsse3(base, dst, limit);
+	}
+#endif
+	for (; k < count; ++k)
+		dst[k] = base[6 * k];
+}
 
+/*!
+ * Splits BGR image into red, green and blue samples of RGGB mosaic (red in
+ * top-left corner). Red and blue are taken from even and odd rows and columns
+ * respectively, green from the other positions: row y of green channel holds
+ * greens of row y, so it is (width + 1) / 2 wide. On even rows of odd width
+ * images its last sample is not part of the mosaic and repeats its neighbour.
+ */
+std::vector<cv::Mat> bayerSplit(const cv::Mat & img) {
+	std::vector<cv::Mat> channels;
+	bayerSplit(img, channels);
 	return channels;
-
 }
 
-cv::Mat bayerMerge(std::vector<cv::Mat> & channels) {
-	if (channels.size() != 3) {
-		std::cout << "Can't merge bayer! Should be 3 channels, got " << channels.size() << std::endl;
-		return cv::Mat();
+void bayerSplit(const cv::Mat & img, std::vector<cv::Mat> & channels) {
+	if (img.channels() != 3) {
+		std::cout << "Can't split bayer! Should be 3 channels, got " << img.channels() << std::endl;
+		channels.clear();
+		return;
 	}
 
-	cv::Size size( channels[1].size().height, channels[0].size().width + channels[2].size().width );
-	cv::Mat res = cv::Mat::zeros(size, CV_8UC1);
-
-	for (int y = 0; y < size.height; ++y) {
+	cv::Size size = img.size();
+	channels.resize(3);
+	cv::Mat & ch_r = channels[0];
+	cv::Mat & ch_g = channels[1];
+	cv::Mat & ch_b = channels[2];
+	ch_r.create((size.height + 1) / 2, (size.width + 1) / 2, CV_8UC1);
+	ch_g.create(size.height, (size.width + 1) / 2, CV_8UC1);
+	ch_b.create(size.height / 2, size.width / 2, CV_8UC1);
+
+	for (int y = 0; y < size.height; y += 2) {
+		const uchar* img_p = img.ptr <uchar> (y);
+		uchar* img_g = ch_g.ptr <uchar> (y);
 
-		uchar* img_p = res.ptr <uchar> (y);
-		const uchar* img_r = channels[0].ptr <uchar> (y/2);
-		const uchar* img_g = channels[1].ptr <uchar> (y);
-		const uchar* img_b = channels[2].ptr <uchar> (y/2);
+		// red on even, green on odd columns
+		gatherRow(img_p, ch_r.ptr <uchar> (y / 2), 0, 2, size.width);
+		gatherRow(img_p, img_g, 1, 1, size.width);
+		if (size.width % 2)
+			img_g[size.width / 2] = size.width > 1 ? img_g[size.width / 2 - 1] : 0;
+	}
 
+	for (int y = 1; y < size.height; y += 2) {
+		const uchar* img_p = img.ptr <uchar> (y);
 
-		for (int x = 0; x < size.width; ++x) {
-			// blue pixel
-			if ( (y % 2) && (x % 2) ) {
-				img_p[x] = img_b[x/2];
-			}
-			// green pixel
-			else if ( (y % 2) || (x % 2) ) {
-				img_p[x] = img_g[x/2];
-			}
-			// red pixel
-			else {
-				img_p[x] = img_r[x/2];
-			}
-		}
+		// green on even, blue on odd columns
+		gatherRow(img_p, ch_g.ptr <uchar> (y), 0, 1, size.width);
+		gatherRow(img_p, ch_b.ptr <uchar> (y / 2), 1, 0, size.width);
 	}
+}
 
-	//cv::imwrite("bay.bmp", res);
-
+/*!
+ * Builds mosaic from channels made by bayerSplit(), it is as high as green
+ * channel and as wide as red and blue channels together.
+ */
+cv::Mat bayerMerge(std::vector<cv::Mat> & channels) {
+	cv::Mat res;
+	bayerMerge(channels, res);
 	return res;
 }
 
+void bayerMerge(const std::vector<cv::Mat> & channels, cv::Mat & res) {
+	if (channels.size() != 3) {
+		std::cout << "Can't merge bayer! Should be 3 channels, got " << channels.size() << std::endl;
+		res.release();
+		return;
+	}
+
+	cv::Size size(channels[0].size().width + channels[2].size().width, channels[1].size().height);
+	res.create(size, CV_8UC1);
+
+	for (int y = 0; y < size.height; y += 2)
+		interleaveRow(channels[0].ptr <uchar> (y / 2), channels[1].ptr <uchar> (y), res.ptr <uchar> (y), size.width);
+
+	for (int y = 1; y < size.height; y += 2)
+		interleaveRow(channels[1].ptr <uchar> (y), channels[2].ptr <uchar> (y / 2), res.ptr <uchar> (y), size.width);
+}
+
+template <typename T>
+static void mosaicSplitRows(const cv::Mat & img, std::vector<cv::Mat> & channels) {
+	int width = img.size().width;
+	for (int y = 0; y < img.size().height; ++y) {
+		int k = 2 * (y % 2);
+		deinterleaveRow(img.ptr <T> (y), channels[k].ptr <T> (y / 2), channels[k + 1].ptr <T> (y / 2), width);
+	}
+}
+
+template <typename T>
+static void mosaicMergeRows(const std::vector<cv::Mat> & channels, cv::Mat & img) {
+	int width = img.size().width;
+	for (int y = 0; y < img.size().height; ++y) {
+		int k = 2 * (y % 2);
+		interleaveRow(channels[k].ptr <T> (y / 2), channels[k + 1].ptr <T> (y / 2), img.ptr <T> (y), width);
+	}
+}
+
+std::vector<cv::Mat> mosaicSplit(const cv::Mat & img) {
+	std::vector<cv::Mat> channels;
+	mosaicSplit(img, channels);
+	return channels;
+}
+
+void mosaicSplit(const cv::Mat & img, std::vector<cv::Mat> & channels) {
+	if (img.channels() != 1) {
+		std::cout << "Can't split mosaic! Should be 1 channel, got " << img.channels() << std::endl;
+		channels.clear();
+		return;
+	}
+
+	cv::Size size = img.size();
+	channels.resize(4);
+	for (int py = 0; py < 2; ++py)
+		for (int px = 0; px < 2; ++px)
+			channels[2 * py + px].create((size.height + 1 - py) / 2, (size.width + 1 - px) / 2, img.type());
+
+	if (img.depth() == CV_16U)
+		mosaicSplitRows<uint16_t>(img, channels);
+	else
+		mosaicSplitRows<uchar>(img, channels);
+}
+
+cv::Mat mosaicMerge(const std::vector<cv::Mat> & channels) {
+	cv::Mat img;
+	mosaicMerge(channels, img);
+	return img;
+}
+
+void mosaicMerge(const std::vector<cv::Mat> & channels, cv::Mat & img) {
+	if (channels.size() != 4) {
+		std::cout << "Can't merge mosaic! Should be 4 channels, got " << channels.size() << std::endl;
+		img.release();
+		return;
+	}
+
+	img.create(channels[0].size().height + channels[2].size().height,
+			channels[0].size().width + channels[1].size().width, channels[0].type());
+
+	if (img.depth() == CV_16U)
+		mosaicMergeRows<uint16_t>(channels, img);
+	else
+		mosaicMergeRows<uchar>(channels, img);
+}
+
+// ===============================================================================================
+//
+// Reversible color transform
+//
+// ===============================================================================================
+
+#if defined(__SSE2__)
+static inline __m128i load8(const uchar * p) {
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+}
+
+static inline __m128i load8(const uint16_t * p) {
+	return _mm_loadu_si128((const __m128i*)p);
+}
+
+static inline void store8(uchar * p, __m128i v) {
+	_mm_storel_epi64((__m128i*)p, _mm_packus_epi16(v, v));
+}
+
+static inline void store8(uint16_t * p, __m128i v) {
+	_mm_storeu_si128((__m128i*)p, v);
+}
+#endif
+
+/*!
+ * YCoCg-R of \a n pixels given as planar rows, chroma is offset by \a offset
+ * (so it is never negative). Values up to 12 bits fit 16-bit lanes.
+ */
+template <typename T>
+static void ycocgRow(const T * b, const T * g, const T * r, T * y, uint16_t * co, uint16_t * cg, int n, int offset) {
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i off = _mm_set1_epi16(offset);
+	for (; x + 8 <= n; x += 8) {
+		__m128i vb = load8(b + x);
+		__m128i vco = _mm_sub_epi16(load8(r + x), vb);
+		__m128i vt = _mm_add_epi16(vb, _mm_srai_epi16(vco, 1));
+		__m128i vcg = _mm_sub_epi16(load8(g + x), vt);
+		store8(y + x, _mm_add_epi16(vt, _mm_srai_epi16(vcg, 1)));
+		_mm_storeu_si128((__m128i*)(co + x), _mm_add_epi16(vco, off));
+		_mm_storeu_si128((__m128i*)(cg + x), _mm_add_epi16(vcg, off));
+	}
+#endif
+	for (; x < n; ++x) {
+		int vco = r[x] - b[x];
+		int vt = b[x] + (vco >> 1);
+		int vcg = g[x] - vt;
+		y[x] = vt + (vcg >> 1);
+		co[x] = vco + offset;
+		cg[x] = vcg + offset;
+	}
+}
+
+/*!
+ * Inverse of ycocgRow(). Components are clamped to [0, offset), which only
+ * matters for lossy coded chroma.
+ */
+template <typename T>
+static void rgbRow(const T * y, const uint16_t * co, const uint16_t * cg, T * b, T * g, T * r, int n, int offset) {
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i off = _mm_set1_epi16(offset);
+	const __m128i lo = _mm_setzero_si128();
+	const __m128i hi = _mm_set1_epi16(offset - 1);
+	for (; x + 8 <= n; x += 8) {
+		__m128i vco = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(co + x)), off);
+		__m128i vcg = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(cg + x)), off);
+		__m128i vt = _mm_sub_epi16(load8(y + x), _mm_srai_epi16(vcg, 1));
+		__m128i vb = _mm_sub_epi16(vt, _mm_srai_epi16(vco, 1));
+		store8(g + x, _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(vcg, vt), lo), hi));
+		store8(r + x, _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(vb, vco), lo), hi));
+		store8(b + x, _mm_min_epi16(_mm_max_epi16(vb, lo), hi));
+	}
+#endif
+	for (; x < n; ++x) {
+		int vco = co[x] - offset;
+		int vcg = cg[x] - offset;
+		int vt = y[x] - (vcg >> 1);
+		int vb = vt - (vco >> 1);
+		g[x] = std::max(0, std::min(offset - 1, vcg + vt));
+		r[x] = std::max(0, std::min(offset - 1, vb + vco));
+		b[x] = std::max(0, std::min(offset - 1, vb));
+	}
+}
+
+template <typename T>
+static void ycocgRows(const std::vector<cv::Mat> & bgr, std::vector<cv::Mat> & channels, int offset) {
+	for (int y = 0; y < bgr[0].size().height; ++y)
+		ycocgRow(bgr[0].ptr <T> (y), bgr[1].ptr <T> (y), bgr[2].ptr <T> (y), channels[0].ptr <T> (y),
+				channels[1].ptr <uint16_t> (y), channels[2].ptr <uint16_t> (y), bgr[0].size().width, offset);
+}
+
+template <typename T>
+static void rgbRows(const std::vector<cv::Mat> & channels, std::vector<cv::Mat> & bgr, int offset) {
+	for (int y = 0; y < bgr[0].size().height; ++y)
+		rgbRow(channels[0].ptr <T> (y), channels[1].ptr <uint16_t> (y), channels[2].ptr <uint16_t> (y),
+				bgr[0].ptr <T> (y), bgr[1].ptr <T> (y), bgr[2].ptr <T> (y), bgr[0].size().width, offset);
+}
+
+std::vector<cv::Mat> ycocgSplit(const cv::Mat & img, int depth) {
+	std::vector<cv::Mat> channels;
+	std::vector<cv::Mat> bgr;
+	ycocgSplit(img, depth, channels, bgr);
+	return channels;
+}
+
+void ycocgSplit(const cv::Mat & img, int depth, std::vector<cv::Mat> & channels, std::vector<cv::Mat> & bgr) {
+	if (img.channels() != 3 || depth > 12) {
+		std::cout << "Can't convert to YCoCg! Should be 3 channels of up to 12 bits, got "
+				<< img.channels() << " of " << depth << std::endl;
+		channels.clear();
+		return;
+	}
+
+	cv::split(img, bgr);
+	channels.resize(3);
+	channels[0].create(img.size(), bgr[0].type());
+	channels[1].create(img.size(), CV_16UC1);
+	channels[2].create(img.size(), CV_16UC1);
+
+	if (img.depth() == CV_16U)
+		ycocgRows<uint16_t>(bgr, channels, 1 << depth);
+	else
+		ycocgRows<uchar>(bgr, channels, 1 << depth);
+}
+
+cv::Mat ycocgMerge(const std::vector<cv::Mat> & channels, int depth) {
+	cv::Mat result;
+	std::vector<cv::Mat> bgr;
+	ycocgMerge(channels, depth, result, bgr);
+	return result;
+}
+
+void ycocgMerge(const std::vector<cv::Mat> & channels, int depth, cv::Mat & img, std::vector<cv::Mat> & bgr) {
+	if (channels.size() != 3) {
+		std::cout << "Can't convert from YCoCg! Should be 3 channels, got " << channels.size() << std::endl;
+		img.release();
+		return;
+	}
+
+	if (channels[1].depth() != CV_16U || channels[2].depth() != CV_16U || channels[1].size() != channels[0].size()
+			|| channels[2].size() != channels[0].size()) {
+		std::cout << "Can't convert from YCoCg! Chroma should be 16-bit channels of luma size" << std::endl;
+		img.release();
+		return;
+	}
+
+	bgr.resize(3);
+	for (int i = 0; i < 3; ++i)
+		bgr[i].create(channels[0].size(), channels[0].type());
+
+	if (channels[0].depth() == CV_16U)
+		rgbRows<uint16_t>(channels, bgr, 1 << depth);
+	else
+		rgbRows<uchar>(channels, bgr, 1 << depth);
+
+	cv::merge(bgr, img);
+}
+
 // ===============================================================================================
 //
 // Huffman encoding
@@ -697,7 +2036,7 @@ cv::Mat bayerMerge(std::vector<cv::Mat> & channels) {
 
 using namespace std;
 
-int * compute_histogram (ifstream & inf, int size, bool bits16, int & last)
+int * compute_histogram (istream & inf, int size, bool bits16, int & last)
 {
 	int * hist = new int [size];
 	for (int i = 0; i < size; i++)
@@ -723,29 +2062,43 @@ int * compute_histogram (ifstream & inf, int size, bool bits16, int & last)
 	return hist;
 }
 
-void enchuf(const std::string & in_f, const std::string & out_f)
+int enchuf(const std::string & in_f, const std::string & out_f)
 {
-	int i;
-	bool bits16 = false;
-
 	ifstream inf (in_f.c_str(), ios::in | ios::binary);
 	if (inf.fail ())
 	{
 		cerr << "error : unable to open input file '" << in_f << "'." << endl;
-		return;
+		return 0;
 	}
 
-	BitFileOut outf (out_f.c_str());
+	ofstream outf (out_f.c_str(), ios::out | ios::binary);
+	if (outf.fail ())
+	{
+		cerr << "error : unable to open output file '" << out_f << "'." << endl;
+		return 0;
+	}
+
+	return enchuf (inf, outf);
+}
+
+int enchuf(std::istream & inf, std::ostream & out)
+{
+	int i;
+	bool bits16 = false;
+	int symbols = 0;
+
+	BitFileOut outf (out);
 
 	int last = -1;
 
 	int size = bits16 ? 65536 : 256;
 
+	std::streampos start = inf.tellg ();
 	int * hist = compute_histogram (inf, size, bits16, last);
 
 	inf.clear ();
 	inf.seekg (0, ios::end);
-	int input_count = inf.tellg ();
+	int input_count = (int) (inf.tellg () - start);
 
 	if (input_count > 0)
 	{
@@ -789,6 +2142,8 @@ void enchuf(const std::string & in_f, const std::string & out_f)
 		if (cnt >= 256)
 			big |= 2;
 
+		symbols = cnt + 1;
+
 		if (last != -1)
 			big |= 4;
 
@@ -821,7 +2176,7 @@ void enchuf(const std::string & in_f, const std::string & out_f)
 			}
 
 		inf.clear ();
-		inf.seekg (0);
+		inf.seekg (start);
 		for (;;)
 		{
 			int chr = inf.get ();
@@ -843,23 +2198,34 @@ void enchuf(const std::string & in_f, const std::string & out_f)
 
 	delete [] hist;
 
-	int output_count = outf.length ();
-
-	//std::cout << "After Huffman: " << input_count << "->" << output_count << " (" << (100 - 100.0*output_count/input_count) << "% less)\n";
+	return symbols;
 }
 
-void dechuf(const std::string & in_f, const std::string & out_f)
+int dechuf(const std::string & in_f, const std::string & out_f)
 {
-	BitFileIn inf (in_f.c_str());
+	ifstream in (in_f.c_str(), ios::in | ios::binary);
+	if (in.fail ())
+	{
+		cerr << "error : unable to open input file '" << in_f << "'." << endl;
+		return -1;
+	}
 
 	ofstream outf (out_f.c_str(), ios::out | ios::binary);
 	if (outf.fail ())
 	{
 		cerr << "error : unable to open output file '" << out_f << "'." << endl;
-		return;
+		return -1;
 	}
 
+	return dechuf (in, outf);
+}
+
+int dechuf(std::istream & in, std::ostream & outf)
+{
+	BitFileIn inf (in);
+
 	int input_count = inf.length ();
+	int symbols = 0;
 
 	if (input_count > 0)
 	try
@@ -875,15 +2241,19 @@ void dechuf(const std::string & in_f, const std::string & out_f)
 
 		int cnt = inf.read_bits (big&2 ? 16 : 8);
 		cnt += 1;
+		symbols = cnt + 1;
 
 		if (cnt > 0)
 		{
-			dataS * data = new dataS [size + 1];
+			// every index comes from the file, so it is checked before use
+			std::vector<dataS> data (size + 1);
 			int j;
 			for (j = 0; j < size + 1; j++)
 				data [j].size = 0;
 
 			j = inf.read_bits (32);
+			if (j < 0 || j > size)
+				throw __LINE__;
 			data [j].code = -1;
 			data [j].size = inf.read_bits ((big&1) ? 16 : 8);
 			j = 0;
@@ -891,38 +2261,50 @@ void dechuf(const std::string & in_f, const std::string & out_f)
 			int i;
 			for (i = 0; i < cnt; i++)
 			{
+				if (j > size)
+					throw __LINE__;
 				if (data [j].size != 0)
 					j ++;
+				if (j > size)
+					throw __LINE__;
 				data [j].code = inf.read_bits (bits16 ? 16 : 8);
 				data [j].size = inf.read_bits ((big&1) ? 16 : 8);
 				j ++;
 			}
 
 			int ii = 0;
-			Node * root = build (ii, data, j, 0);
-
-			delete [] data;
+			Node * root = build (ii, &data [0], j, 0);
 
 			Node * node = root;
-			for (;;)
+			try
 			{
-				node = node -> Decend (inf.GetBit ());
+				for (;;)
+				{
+					node = node -> Decend (inf.GetBit ());
 
-				if (node == NULL)
-					throw __LINE__;
+					if (node == NULL)
+						throw __LINE__;
 
-				if (node -> IsLeaf ())
-				{
-					int code = node -> Code ();
-					if (code == -1)
-						break;
+					if (node -> IsLeaf ())
+					{
+						int code = node -> Code ();
+						if (code == -1)
+							break;
 
-					outf << static_cast<unsigned char>(code);
-					if (bits16) outf << static_cast<unsigned char>(code>>8);
+						outf << static_cast<unsigned char>(code);
+						if (bits16) outf << static_cast<unsigned char>(code>>8);
 
-					node = root;
+						node = root;
+					}
 				}
 			}
+			catch (int)
+			{
+				delete root;
+				throw;
+			}
+
+			delete root;
 
 			if (last != -1)
 			{
@@ -933,12 +2315,10 @@ void dechuf(const std::string & in_f, const std::string & out_f)
 	catch (int line)
 	{
 		cerr << "error ("<<line<<"): not a huffman encoded file." << endl;
-		return;
+		return -1;
 	}
 
-	int output_count = outf.tellp ();
-
-	std::cout << "After Huffman: " << input_count << "->" << output_count << " (" << (100 - 100.0*output_count/input_count) << "% less)\n";
+	return symbols;
 }
 
 // ===============================================================================================
@@ -947,265 +2327,1170 @@ void dechuf(const std::string & in_f, const std::string & out_f)
 //
 // ===============================================================================================
 
-struct Header {
-	bool gray;
-	bool exor;
-	int channels;
-	// 1 - RGB, 2 - HSV
-	int conversion;
-	// 0 - none, 1 - huffman
-	int post;
+/*!
+ * CRC32C slicing-by-8 lookup tables, reflected polynomial 0x82F63B78. Table k
+ * advances CRC of a byte by k more zero bytes.
+ */
+struct CrcTable {
+	CrcTable() {
+		for (int i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+			v[0][i] = c;
+		}
+		for (int k = 1; k < 8; ++k)
+			for (int i = 0; i < 256; ++i)
+				v[k][i] = (v[k-1][i] >> 8) ^ v[0][v[k-1][i] & 0xFF];
+	}
+
+	uint32_t v[8][256];
 };
 
-void storeRaw(std::ofstream & f, const std::string & fname) {
-	std::ifstream inf(fname.c_str(), std::ios_base::in | std::ios_base::binary);
-	inf.clear ();
-	inf.seekg (0, ios::end);
-	int input_count = inf.tellg ();
-	inf.seekg (0, std::ios::beg);
+static const CrcTable crc_table;
 
-	//std::cout << input_count << std::endl;
-	char * buf = new char[input_count];
+#if defined(__x86_64__) && defined(__GNUC__)
+/*!
+ * The crc32 instruction takes 8 bytes at a time. Compiled for SSE4.2 whatever
+ * the target is, crc32c() calls it only if the CPU has it.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(const uchar * p, size_t n, uint32_t crc) {
+	uint64_t c = crc;
+	for (; n >= 8; n -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	crc = (uint32_t)c;
+	for (; n > 0; --n, ++p)
+		crc = _mm_crc32_u8(crc, *p);
+	return crc;
+}
+#endif
 
-	inf.read(buf, input_count);
-	f.write((char*)&input_count, 4);
-	f.write(buf, input_count);
+/*!
+ * With SSE4.2 the crc32 instruction is used, otherwise 8 bytes are looked up
+ * in 8 tables at once.
+ */
+uint32_t crc32c(const void * data, size_t n, uint32_t crc) {
+	const uchar * p = (const uchar *)data;
+	crc = ~crc;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (has_sse42)
+		return ~crc32cSse42(p, n, crc);
+#endif
+
+	for (; n >= 8; n -= 8, p += 8) {
+		uint32_t lo = (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) ^ crc;
+		uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = crc_table.v[7][lo & 0xFF] ^ crc_table.v[6][(lo >> 8) & 0xFF]
+			^ crc_table.v[5][(lo >> 16) & 0xFF] ^ crc_table.v[4][lo >> 24]
+			^ crc_table.v[3][hi & 0xFF] ^ crc_table.v[2][(hi >> 8) & 0xFF]
+			^ crc_table.v[1][(hi >> 16) & 0xFF] ^ crc_table.v[0][hi >> 24];
+	}
+	for (; n > 0; --n, ++p)
+		crc = crc_table.v[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
 
-	inf.close();
-	delete [] buf;
+	return ~crc;
 }
 
-void retrieveRaw(std::ifstream & f, const std::string & fname) {
-	std::ofstream outf(fname.c_str(), std::ios_base::out | std::ios_base::binary);
+static const char MAGIC[4] = { 'R', 'L', 'E', 'C' };
+
+void writeHeader(std::ostream & f, const Header & header) {
+	f.write(MAGIC, 4);
+	writeLE(f, FORMAT_VERSION, 1);
+	writeLE(f, (header.gray ? 1 : 0) | (header.exor ? 2 : 0) | (header.crc ? 4 : 0), 1);
+	writeLE(f, header.channels, 1);
+	writeLE(f, header.depth, 1);
+	writeLE(f, header.conversion, 1);
+	writeLE(f, header.cfa, 1);
+	writeLE(f, header.post, 1);
+	for (int i = 0; i < MAX_CHANNELS; ++i)
+		writeLE(f, header.planes[i], 1);
+}
 
-	int input_count;
-	f.read((char*)&input_count, 4);
-	//std::cout << input_count << std::endl;
+bool readHeader(std::istream & f, Header & header) {
+	char magic[4] = {0};
+	f.read(magic, 4);
+	if (!f || memcmp(magic, MAGIC, 4) != 0) {
+		std::cout << "Not a coded file" << std::endl;
+		return false;
+	}
 
-	char * buf = new char[input_count];
-	f.read(buf, input_count);
-	outf.write(buf, input_count);
+	int version = readLE(f, 1);
+	if (version != FORMAT_VERSION) {
+		std::cout << "Unsupported format version: " << version << std::endl;
+		return false;
+	}
 
-	outf.close();
-	delete [] buf;
+	int flags = readLE(f, 1);
+	header.gray = flags & 1;
+	header.exor = flags & 2;
+	header.crc = flags & 4;
+	header.channels = readLE(f, 1);
+	header.depth = readLE(f, 1);
+	header.conversion = readLE(f, 1);
+	header.cfa = readLE(f, 1);
+	header.post = readLE(f, 1);
+	for (int i = 0; i < MAX_CHANNELS; ++i)
+		header.planes[i] = readLE(f, 1);
+	header.psnr = 0;
+
+	return (bool)f;
 }
 
-bool encode(const std::string & in_fname, const std::string & out_fname, Header header) {
+/*!
+ * Bytes every plane record takes besides its stream: record header and CRC,
+ * and plane header RleBuffer::saveToFile() writes before the words.
+ */
+static const int RECORD_OVERHEAD = 7 + 4 + 12;
 
+/*!
+ * Record header fields as stored, covered by the checksum.
+ */
+static void recordHeader(const PlaneRecord & record, uchar * buf) {
+	buf[0] = record.channel;
+	buf[1] = record.plane;
+	buf[2] = record.flags;
+	for (int i = 0; i < 4; ++i)
+		buf[3 + i] = (uchar)(record.data.size() >> (8 * i));
+}
 
-	cv::Mat img = cv::imread(in_fname.c_str());
-	if (img.empty()) {
-		std::cout << "Can't load image from file: " << in_fname << std::endl;
+static uint32_t recordCrc(const PlaneRecord & record) {
+	uchar buf[7];
+	recordHeader(record, buf);
+	return crc32c(record.data.data(), record.data.size(), crc32c(buf, 7));
+}
+
+void writeRecord(std::ostream & f, const PlaneRecord & record, bool crc) {
+	uchar buf[7];
+	recordHeader(record, buf);
+	f.write((const char*)buf, 7);
+	writeLE(f, crc ? recordCrc(record) : 0, 4);
+	f.write(record.data.data(), record.data.size());
+}
+
+bool readRecord(std::istream & f, PlaneRecord & record, bool check) {
+	record.channel = readLE(f, 1);
+	record.plane = readLE(f, 1);
+	record.flags = readLE(f, 1);
+	uint32_t length = readLE(f, 4);
+	uint32_t crc = readLE(f, 4);
+	if (!f)
+		return false;
+
+	// truncated file must not make us allocate the claimed length
+	std::streampos pos = f.tellg();
+	f.seekg(0, std::ios::end);
+	std::streamoff left = f.tellg() - pos;
+	f.seekg(pos);
+	if (left < length)
+		return false;
+
+	record.data.resize(length);
+	f.read(&record.data[0], length);
+	if (!f)
 		return false;
+
+	return !check || recordCrc(record) == crc;
+}
+
+/*!
+ * Adds wall time spent in its scope to \a counter, does nothing if it is NULL.
+ */
+class ScopedTimer {
+public:
+	ScopedTimer(double * counter) : m_counter(counter) {
+		if (m_counter)
+			m_start = std::chrono::steady_clock::now();
 	}
 
-	std::ofstream f(out_fname.c_str(), std::ios_base::out | std::ios_base::binary);
+	~ScopedTimer() {
+		if (m_counter)
+			*m_counter += std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+	}
 
-	std::vector<cv::Mat> channels;
+private:
+	double * m_counter;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+static double * stage(CodecStats * stats, double StageTimes::* member) {
+	return stats ? &(stats->times.*member) : NULL;
+}
 
-	if (img.channels() > 1) {
+void CodecStats::writeJson(std::ostream & out) const {
+	out << "{\n";
+	out << "  \"times\": {\"read\": " << times.read << ", \"split\": " << times.split
+		<< ", \"gray\": " << times.gray << ", \"xor\": " << times.exor << ", \"rle\": " << times.rle
+		<< ", \"huffman\": " << times.huffman << ", \"write\": " << times.write
+		<< ", \"search\": " << times.search << "},\n";
+	out << "  \"bytes_in\": " << bytes_in << ",\n";
+	out << "  \"bytes_out\": " << bytes_out << ",\n";
+	out << "  \"runs\": " << runs << ",\n";
+	out << "  \"planes\": [";
+	for (int i = 0; i < planes.size(); ++i) {
+		const PlaneStats & p = planes[i];
+		out << (i ? ",\n" : "\n") << "    {\"channel\": " << p.channel << ", \"plane\": " << p.plane
+			<< ", \"mode\": " << p.mode << ", \"predictor\": " << p.predictor << ", \"type\": " << p.type << ", \"runs\": " << p.runs
+			<< ", \"rle_bytes\": " << p.rle_bytes << ", \"coded_bytes\": " << p.coded_bytes
+			<< ", \"huffman_codes\": " << p.huffman_codes << "}";
+	}
+	out << "\n  ]\n}\n";
+}
+
+/*!
+ * Splits image into channels coded separately, applying colorspace conversion.
+ * Converted image is kept in \a ctx buffers on the way.
+ */
+static void splitChannels(const cv::Mat & img, int conversion, int depth, std::vector<cv::Mat> & channels, CodecContext & ctx) {
+	if (conversion == 4) {
+		mosaicSplit(img, channels);
+	} else if (img.channels() > 1) {
 		// split image into channels
-		if (header.conversion == 3) {
-			channels = bayerSplit(img);
+		if (conversion == 5) {
+			ycocgSplit(img, depth, channels, ctx.bgr);
+		} else if (conversion == 3) {
+			bayerSplit(img, channels);
+		} else if (conversion == 2) {
+			cv::cvtColor(img, ctx.converted, CV_BGR2HSV);
+			cv::split(ctx.converted, channels);
 		} else {
-			if (header.conversion == 2) {
-				cv::cvtColor(img, img, CV_BGR2HSV);
-			}
 			cv::split(img, channels);
 		}
 	} else {
 		// image is one channel
-		channels.push_back(img);
+		channels.resize(1);
+		channels[0] = img;
 	}
+}
 
-	header.channels = channels.size();
+/*!
+ * Per plane predictor lists predicting every plane the same way, indexed by
+ * Predictor.
+ */
+struct UniformPredictors {
+	UniformPredictors() {
+		for (int k = 0; k < PREDICTORS; ++k)
+			planes[k].assign(MAX_DEPTH, k);
+	}
+
+	std::vector<int> planes[PREDICTORS];
+};
+
+static const UniformPredictors uniform_predictors;
 
-	f.write((char*)&header, sizeof(header));
+/*!
+ * Candidate residuals of a channel: gray coded channel, and if \a exor is set,
+ * its residuals against every predictor (indexed by Predictor). Returns number
+ * of candidates, residuals past them are left as they were.
+ */
+static int channelResiduals(const cv::Mat & channel, bool gray, bool exor, CodecStats * stats, std::vector<cv::Mat> & residuals) {
+	residuals.resize(PREDICTORS);
+
+	{
+		ScopedTimer timer(stage(stats, &StageTimes::gray));
+		encodeChannel(channel, gray, residuals[PRED_NONE]);
+	}
+
+	if (!exor)
+		return 1;
+
+	ScopedTimer timer(stage(stats, &StageTimes::exor));
+	for (int k = PRED_LEFT; k < PREDICTORS; ++k)
+		predictChannel(residuals[PRED_NONE], uniform_predictors.planes[k], residuals[k]);
+
+	return PREDICTORS;
+}
 
-	if (header.gray) {
-		for (int i = 0; i < channels.size(); ++i) {
-			channels[i] = nkb2gray(channels[i]);
+// shortest average run of planes worth trying PLANE_READ for
+static const int READ_MIN_RUN = 8;
+
+/*!
+ * Picks cheapest way of storing plane \a p: raw bits, or runs (or READ codes)
+ * with predictor and fixed codebook or Huffman coded classes giving the shortest
+ * stream. Only the first \a candidates residuals are tried. Runs and READ
+ * codes are counted in \a ctx, together with the unpredicted packed plane, so
+ * codePlane() stores the choice without scanning again. Returns the record
+ * payload size.
+ */
+static int choosePlaneCoding(const std::vector<cv::Mat> & residuals, int candidates, int p, int & mode, RleCodebook & codebook, int & predictor, CodecContext & ctx) {
+	int best = -1;
+	mode = PLANE_RLE;
+	codebook = RleCodebook(0);
+	predictor = PRED_NONE;
+	ctx.runs.resize(PREDICTORS);
+
+	for (int k = 0; k < candidates; ++k) {
+		PackedPlane & packed = k == PRED_NONE ? ctx.packed : ctx.predicted;
+		packPlane(residuals[k], p, packed);
+		PlaneRuns & runs = ctx.runs[k];
+		runs.clear();
+		runs.first_symbol = scanRuns(packed, runs);
+
+		// runs too long for every fixed codebook are left to Huffman codes
+		int sz;
+		RleCodebook cb = runs.lengths.fixed(sz);
+		if (sz >= 0 && (best < 0 || sz < best)) {
+			best = sz;
+			mode = PLANE_RLE;
+			codebook = cb;
+			predictor = k;
+		}
+
+		// run length codebooks win only on planes with few runs, where the codes cost more
+		sz = runs.classes.size(runs.codes);
+		if (best < 0 || sz < best) {
+			best = sz;
+			mode = PLANE_HUFFMAN;
+			codebook = RleCodebook(0);
+			predictor = k;
 		}
 	}
 
-	// split image into bitplanes
-	for (int i = 0; i < header.channels; ++i) {
-		for (int p = 0; p < 8; ++p) {
-			int best = 0;
-			int bestt = -1;
-			cv::Mat bp = getBitPlane(channels[i], p);
-			if (header.exor) {
-				bp = en_xor(bp);
-			}
-			for (int type=0; type < 6; ++type) {
-				RleBuffer buf = rle(bp, type);
-				if (bestt < 0 || buf.size() < best) {
-					best = buf.size();
-					bestt = type;
+	// rows coded against the row above; it already predicts from above, so only
+	// the plane itself is tried, and only if its runs are long enough to follow
+	// (on photos READ wins with runs of 8 pixels on average and more)
+	const PackedPlane & plane = ctx.packed;
+	if ((int64_t)ctx.runs[PRED_NONE].lengths.runs * READ_MIN_RUN <= (int64_t)plane.width * plane.height) {
+		ReadHistogram & read = ctx.read;
+		read.clear();
+		scanRead(plane, read, ctx.changes);
+		RleCodebook cb_read(0);
+		int sz = read.size(cb_read);
+		if (sz >= 0 && sz < best) {
+			best = sz;
+			mode = PLANE_READ;
+			codebook = cb_read;
+			predictor = PRED_NONE;
+		}
+	}
+
+	// runs too short to pay off, e.g. in noise-like low planes
+	int raw = RleBuffer::rawSize(plane.width, plane.height);
+	if (raw <= best) {
+		best = raw;
+		mode = PLANE_RAW;
+		predictor = PRED_NONE;
+	}
+
+	return best;
+}
+
+/*!
+ * Fits codebook to runs of plane coded as choosePlaneCoding() picked it with
+ * fixed \a codebook, which is replaced if the fitted one gives shorter record.
+ * Fitting is costly, so the choice itself is made with fixed codebooks only.
+ * Returns the new payload size, \a bytes is the old one.
+ */
+static int fitPlaneCodebook(int mode, RleCodebook & codebook, int predictor, int bytes, CodecContext & ctx) {
+	if (mode != PLANE_RLE && mode != PLANE_READ)
+		return bytes;
+
+	RunHistogram & hist = mode == PLANE_READ ? ctx.read.runs : ctx.runs[predictor].lengths;
+	int stream = hist.size(codebook);
+	int sz;
+	codebook = hist.best(sz);
+	return bytes - stream + sz;
+}
+
+/*!
+ * Stores plane as choosePlaneCoding() picked it into \a buf, from runs and
+ * READ codes it counted in \a ctx. The stream is \a bytes long.
+ */
+static void codePlane(int mode, const RleCodebook & codebook, int predictor, int bytes, CodecContext & ctx, RleBuffer & buf) {
+	int width = ctx.packed.width;
+	int height = ctx.packed.height;
+	const PlaneRuns & runs = ctx.runs[predictor];
+
+	if (mode == PLANE_RAW) {
+		buf.reset(RleCodebook(0), 0, 0);
+		buf.setRaw(ctx.packed);
+		return;
+	}
+
+	if (mode == PLANE_HUFFMAN) {
+		classesCode(runs, bytes, width, height, buf);
+	} else if (mode == PLANE_READ) {
+		readCode(ctx.read, codebook, bytes, width, height, buf);
+	} else {
+		buf.reset(codebook, width, height);
+		buf.reserve(bytes);
+		buf.setFirstSymbol(runs.first_symbol);
+		runs.replay(buf);
+		buf.finish();
+	}
+	buf.setPredictor(predictor);
+}
+
+/*!
+ * Number of planes of channel \a i.
+ */
+static int channelDepth(const Header & header, int i) {
+	// YCoCg-R chroma needs one bit more
+	return header.conversion == 5 && i > 0 ? header.depth + 1 : header.depth;
+}
+
+/*!
+ * Number of planes stored for channel \a i.
+ */
+static int keptPlanes(const Header & header, int i) {
+	return std::max(1, std::min(channelDepth(header, i), header.planes[std::min(i, MAX_CHANNELS - 1)]));
+}
+
+int imageDepth(const cv::Mat & img) {
+	if (img.depth() == CV_8U)
+		return 8;
+	if (img.depth() != CV_16U)
+		return 0;
+
+	uint16_t max = 0;
+	cv::Size size(img.size().width * img.channels(), img.size().height);
+	for (int y = 0; y < size.height; ++y) {
+		const uint16_t* img_p = img.ptr <uint16_t> (y);
+		for (int x = 0; x < size.width; ++x)
+			max = std::max(max, img_p[x]);
+	}
+
+	if (max < (1 << 10))
+		return 10;
+	if (max < (1 << 12))
+		return 12;
+	return 16;
+}
+
+/*!
+ * Picks every AUTO_SAMPLE_STEP-th block of AUTO_SAMPLE_ROWS rows. Blocks start
+ * at even rows, so Bayer pattern is kept.
+ */
+static const int AUTO_SAMPLE_ROWS = 8;
+static const int AUTO_SAMPLE_STEP = 8;
+
+static void sampleRows(const cv::Mat & img, cv::Mat & result) {
+	int height = img.size().height;
+	if (height < 4 * AUTO_SAMPLE_ROWS * AUTO_SAMPLE_STEP) {
+		result = img;
+		return;
+	}
+
+	int blocks = height / (AUTO_SAMPLE_ROWS * AUTO_SAMPLE_STEP);
+	result.create(blocks * AUTO_SAMPLE_ROWS, img.size().width, img.type());
+	size_t row_bytes = img.size().width * img.elemSize();
+
+	for (int b = 0; b < blocks; ++b)
+		for (int r = 0; r < AUTO_SAMPLE_ROWS; ++r)
+			memcpy(result.ptr <uchar> (b * AUTO_SAMPLE_ROWS + r),
+					img.ptr <uchar> (b * AUTO_SAMPLE_ROWS * AUTO_SAMPLE_STEP + r), row_bytes);
+}
+
+Header autoHeader(const cv::Mat & img, Header header, CodecContext * context) {
+	if (!context) {
+		CodecContext ctx;
+		return autoHeader(img, header, &ctx);
+	}
+
+	CodecContext & ctx = *context;
+	cv::Mat & sample = ctx.sample;
+	sampleRows(img, sample);
+
+	// HSV and Bayer lose data, so only lossless conversions take part
+	int conversions[] = { 1, 5 };
+
+	int64_t best = -1;
+	Header result = header;
+
+	int tried = sizeof(conversions) / sizeof(conversions[0]);
+	ctx.sample_channels.resize(tried);
+	ctx.sample_residuals.resize(tried * MAX_CHANNELS);
+
+	for (int c = 0; c < tried; ++c) {
+		if (conversions[c] == 5 && header.depth > 12)
+			continue;
+
+		Header candidate = header;
+		candidate.conversion = conversions[c];
+		std::vector<cv::Mat> & channels = ctx.sample_channels[c];
+		splitChannels(sample, candidate.conversion, candidate.depth, channels, ctx);
+
+		for (int gray = 0; gray < 2; ++gray)
+		for (int exor = 0; exor < 2; ++exor) {
+			int64_t stream = 0;
+			int records = 0;
+			for (int i = 0; i < channels.size(); ++i) {
+				std::vector<cv::Mat> & residuals = ctx.sample_residuals[c * MAX_CHANNELS + i];
+				int candidates = channelResiduals(channels[i], gray, exor, NULL, residuals);
+				int depth = channelDepth(candidate, i);
+				for (int p = depth - keptPlanes(candidate, i); p < depth; ++p) {
+					int mode, predictor;
+					RleCodebook codebook(0);
+					stream += choosePlaneCoding(residuals, candidates, p, mode, codebook, predictor, ctx);
+					records++;
 				}
 			}
 
-			RleBuffer buf = rle(bp, bestt);
-			//std::cout << i << p << ": " << bestt << "@" << buf.size() << std::endl;
+			// YCoCg chroma has a plane more, whose record costs as much as a
+			// short stream; sampled rows stand for the whole image
+			int64_t size = stream * img.size().height / sample.size().height + (int64_t)records * RECORD_OVERHEAD;
 
-			if (header.post == 1) {
-				buf.saveToFile("tmp");
-				enchuf("tmp", "tmp.huf");
-				storeRaw(f, "tmp.huf");
-			} else {
-				buf.saveToFile(f);
+			// prefer cheaper configuration on ties
+			if (best < 0 || size < best) {
+				best = size;
+				result.conversion = conversions[c];
+				result.gray = gray;
+				result.exor = exor;
 			}
 		}
 	}
 
-	return true;
+	return result;
 }
 
-bool decode(const std::string & in_fname, const std::string & out_fname) {
-	Header header;
-	cv::Mat tmp;
+template <typename T>
+static void channelHistogram(const cv::Mat & channel, std::vector<int64_t> & hist) {
+	cv::Size size = channel.size();
+	for (int y = 0; y < size.height; ++y) {
+		const T* img_p = channel.ptr <T> (y);
+		for (int x = 0; x < size.width; ++x)
+			hist[img_p[x]]++;
+	}
+}
 
-	std::ifstream f(in_fname.c_str(), std::ios_base::out | std::ios_base::binary);
+/*!
+ * Squared error of values reconstructed from channels with lowest planes
+ * dropped. Every value gets error terms from one or more channels; for every
+ * channel, number of its dropped planes and value (colour component) the terms
+ * are summed, together with their squares. Terms of different channels are
+ * taken as independent.
+ */
+struct DropErrors {
+	DropErrors(int channels, int components) : channels(channels), components(components), pixels(0),
+			sums(channels * MAX_DEPTH * components, 0), squares(channels * MAX_DEPTH * components, 0) {}
 
-	std::vector<cv::Mat> channels;
+	void add(int i, int d, int k, double term, int64_t count) {
+		sums[(i * MAX_DEPTH + d) * components + k] += term * count;
+		squares[(i * MAX_DEPTH + d) * components + k] += term * term * count;
+	}
 
-	f.read((char*)&header, sizeof(header));
-	for (int i = 0; i < header.channels; ++i) {
-		std::vector<cv::Mat> planes;
-		for (int p = 0; p < 8; ++p) {
-			RleBuffer buf;
-			if (header.post == 1) {
-				retrieveRaw(f, "tmp.huf.raw");
-				dechuf("tmp.huf.raw", "tmp.raw");
-				buf.loadFromFile("tmp.raw");
-			} else {
-				buf.loadFromFile(f);
+	double total(const std::vector<int> & dropped) const {
+		double result = 0;
+		for (int k = 0; k < components; ++k)
+			for (int i = 0; i < channels; ++i) {
+				int a = (i * MAX_DEPTH + dropped[i]) * components + k;
+				result += squares[a];
+				for (int j = i + 1; j < channels; ++j)
+					result += 2 * sums[a] * sums[(j * MAX_DEPTH + dropped[j]) * components + k] / pixels;
 			}
-			tmp = rle(buf);
+		return result;
+	}
 
-			if (header.exor) {
-				tmp = de_xor(tmp);
-			}
+	int channels;
+	int components;
+	// pixels of a channel, only needed when channels share components
+	double pixels;
+	std::vector<double> sums;
+	std::vector<double> squares;
+};
+
+/*!
+ * Squared error of RGB values decoded from YCoCg-R \a channels of \a depth
+ * bits with \a dropped lowest planes filled with their midpoint, as
+ * ycocgMerge() does it.
+ */
+template <typename T>
+static double ycocgDropError(const std::vector<cv::Mat> & channels, const std::vector<int> & dropped, int depth) {
+	int width = channels[0].size().width;
+	int offset = 1 << depth;
+	std::vector<T> y(width), bgr(6 * width);
+	std::vector<uint16_t> co(width), cg(width);
+	T * lossy = &bgr[3 * width];
+
+	int keep[3], fill[3];
+	for (int i = 0; i < 3; ++i) {
+		keep[i] = ~((1 << dropped[i]) - 1);
+		fill[i] = dropped[i] ? 1 << (dropped[i] - 1) : 0;
+	}
+
+	double result = 0;
+	for (int row = 0; row < channels[0].size().height; ++row) {
+		const T* y_p = channels[0].ptr <T> (row);
+		const uint16_t* co_p = channels[1].ptr <uint16_t> (row);
+		const uint16_t* cg_p = channels[2].ptr <uint16_t> (row);
+		rgbRow(y_p, co_p, cg_p, &bgr[0], &bgr[width], &bgr[2 * width], width, offset);
+
+		for (int x = 0; x < width; ++x) {
+			y[x] = (y_p[x] & keep[0]) | fill[0];
+			co[x] = (co_p[x] & keep[1]) | fill[1];
+			cg[x] = (cg_p[x] & keep[2]) | fill[2];
+		}
+		rgbRow(&y[0], &co[0], &cg[0], lossy, lossy + width, lossy + 2 * width, width, offset);
+
+		for (int x = 0; x < 3 * width; ++x) {
+			double e = (double)bgr[x] - lossy[x];
+			result += e * e;
+		}
+	}
+	return result;
+}
+
+/*!
+ * Squared error of BGR values decoded from 8-bit HSV \a channels with
+ * \a dropped lowest planes filled with their midpoint, against \a full BGR
+ * image decoded from all planes.
+ */
+static double hsvDropError(const std::vector<cv::Mat> & channels, const std::vector<int> & dropped, const cv::Mat & full) {
+	std::vector<cv::Mat> lossy(3);
+	for (int i = 0; i < 3; ++i) {
+		int keep = ~((1 << dropped[i]) - 1);
+		int fill = dropped[i] ? 1 << (dropped[i] - 1) : 0;
+		lossy[i].create(channels[i].size(), CV_8UC1);
+		for (int y = 0; y < channels[i].size().height; ++y) {
+			const uchar* src_p = channels[i].ptr <uchar> (y);
+			uchar* dst_p = lossy[i].ptr <uchar> (y);
+			for (int x = 0; x < channels[i].size().width; ++x)
+				dst_p[x] = (src_p[x] & keep) | fill;
+		}
+	}
 
-			planes.push_back(tmp);
+	cv::Mat hsv, bgr;
+	cv::merge(lossy, hsv);
+	cv::cvtColor(hsv, bgr, CV_HSV2BGR);
+
+	double result = 0;
+	int n = full.size().width * full.channels();
+	for (int y = 0; y < full.size().height; ++y) {
+		const uchar* full_p = full.ptr <uchar> (y);
+		const uchar* bgr_p = bgr.ptr <uchar> (y);
+		for (int x = 0; x < n; ++x) {
+			double e = (double)full_p[x] - bgr_p[x];
+			result += e * e;
 		}
+	}
+	return result;
+}
+
+Header lossyPlanes(const std::vector<cv::Mat> & channels, Header header) {
+	int n = std::min((int)channels.size(), MAX_CHANNELS);
 
+	// the target is for the decoded image: YCoCg-R is mixed back as t = Y - (Cg >> 1),
+	// G = Cg + t, B = t - (Co >> 1) and R = B + Co, so every RGB value gets error of Y
+	// and of shifted chroma, whose rounding counts too. Other conversions keep every
+	// channel in its own values.
+	bool ycocg = header.conversion == 5 && n == 3;
+	DropErrors errors(n, ycocg ? 3 : n);
+	double values_total = 0;
 
-		tmp = mergeBitPlanes(planes);
-		if (header.gray)
-			channels.push_back(nkb2gray(tmp, true));
+	for (int i = 0; i < n; ++i) {
+		int depth = channelDepth(header, i);
+		int values = 1 << depth;
+
+		std::vector<int64_t> hist(channels[i].depth() == CV_16U ? 65536 : 256, 0);
+		if (channels[i].depth() == CV_16U)
+			channelHistogram<uint16_t>(channels[i], hist);
 		else
-			channels.push_back(tmp);
+			channelHistogram<uchar>(channels[i], hist);
+		errors.pixels = (double)channels[i].size().width * channels[i].size().height;
+		values_total += errors.pixels;
+
+		for (int d = 1; d < depth; ++d) {
+			int keep_mask = (values - 1) & ~((1 << d) - 1);
+			int fill = 1 << (d - 1);
+			for (int v = 0; v < values; ++v) {
+				if (!hist[v])
+					continue;
+				int rec = (v & keep_mask) | fill;
+				double e = v - rec;
+				// chroma offset is even, so it doesn't change rounding of the shift
+				double shifted = (v >> 1) - (rec >> 1);
+
+				if (!ycocg) {
+					errors.add(i, d, i, e, hist[v]);
+				} else if (i == 0) {
+					// Y, in G, B and R alike
+					for (int k = 0; k < 3; ++k)
+						errors.add(i, d, k, e, hist[v]);
+				} else if (i == 1) {
+					// Co
+					errors.add(i, d, 1, -shifted, hist[v]);
+					errors.add(i, d, 2, e - shifted, hist[v]);
+				} else {
+					// Cg
+					errors.add(i, d, 0, e - shifted, hist[v]);
+					errors.add(i, d, 1, -shifted, hist[v]);
+					errors.add(i, d, 2, -shifted, hist[v]);
+				}
+			}
+		}
 	}
 
-	if (header.conversion == 3) {
-		tmp = bayerMerge(channels);
-		cv::cvtColor(tmp.clone(), tmp, CV_BayerBG2BGR);
-	} else {
-		cv::merge(channels, tmp);
+	double peak = (1 << header.depth) - 1;
+	double limit = peak * peak * values_total / pow(10.0, header.psnr / 10.0);
+
+	std::vector<int> dropped(n);
+	for (int i = 0; i < n; ++i)
+		dropped[i] = channelDepth(header, i) - keptPlanes(header, i);
+	// channels in order their planes were dropped
+	std::vector<int> steps;
+
+	// error of a hue plane depends on saturation and value of the pixel, errors
+	// of HSV channels don't tell which plane costs least in BGR, so every step
+	// is measured on values decoded back
+	bool hsv = header.conversion == 2 && n == 3 && channels[0].depth() == CV_8U;
+	cv::Mat full;
+	if (hsv) {
+		cv::Mat merged;
+		cv::merge(channels, merged);
+		cv::cvtColor(merged, full, CV_HSV2BGR);
+	}
 
-		if (header.conversion == 2) {
-			cv::cvtColor(tmp, tmp, CV_HSV2BGR);
+	for (;;) {
+		int best = -1;
+		double best_total = 0;
+		for (int i = 0; i < n; ++i) {
+			if (dropped[i] >= channelDepth(header, i) - 1)
+				continue;
+			dropped[i]++;
+			double t = hsv ? hsvDropError(channels, dropped, full) : errors.total(dropped);
+			dropped[i]--;
+			if (best < 0 || t < best_total) {
+				best = i;
+				best_total = t;
+			}
 		}
+
+		if (best < 0 || best_total > limit)
+			break;
+
+		dropped[best]++;
+		steps.push_back(best);
 	}
 
-	cv::imwrite(out_fname.c_str(), tmp);
+	// errors of YCoCg channels aren't quite independent when many planes are
+	// dropped, so the estimate is checked on decoded values and the last steps
+	// are taken back while it misses the target
+	while (ycocg && !steps.empty()) {
+		double exact = channels[0].depth() == CV_16U ? ycocgDropError<uint16_t>(channels, dropped, header.depth)
+				: ycocgDropError<uchar>(channels, dropped, header.depth);
+		if (exact <= limit)
+			break;
+		dropped[steps.back()]--;
+		steps.pop_back();
+	}
 
-	return true;
+	for (int i = 0; i < n; ++i)
+		header.planes[i] = channelDepth(header, i) - dropped[i];
+
+	return header;
 }
 
-// ===============================================================================================
-//
-// Entry point
-//
-// ===============================================================================================
+/*!
+ * Stream buffer appending to a string, so that records are written straight
+ * into PlaneRecord::data, reusing its storage.
+ */
+class RecordWriter : public std::streambuf {
+public:
+	RecordWriter(std::string & data) : m_data(data) {
+		m_data.clear();
+	}
 
+protected:
+	int_type overflow(int_type c) {
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+			m_data.push_back(traits_type::to_char_type(c));
+		return traits_type::not_eof(c);
+	}
 
-namespace po = boost::program_options;
+	std::streamsize xsputn(const char * s, std::streamsize n) {
+		m_data.append(s, n);
+		return n;
+	}
 
-int main(int argc, char * argv[]) {
-	// Declare the supported options.
+private:
+	std::string & m_data;
+};
 
-	std::string conversion;
-	std::string input_fname;
-	std::string output_fname;
+/*!
+ * Stream buffer reading from a string in place, without the copy std::istringstream makes.
+ */
+class RecordReader : public std::streambuf {
+public:
+	RecordReader(const std::string & data) {
+		char * begin = const_cast<char *>(data.data());
+		setg(begin, begin, begin + data.size());
+	}
 
-	po::options_description desc("Allowed options");
-	desc.add_options()
-		("help", "produce help message")
-		("conversion,C", po::value<std::string>(&conversion)->default_value("RGB"), "colorspace conversion\n"
-				"possible values are: RGB, HSV, Bayer")
-		("gray,G", "convert channels to Gray encoding")
-		("xor,X", "xor bit planes")
-		("huffman,H", "Huffman encoding")
-		("decode,D", "decode given file")
-		("input,I",po::value<std::string>(&input_fname), "input file")
-		("output,O",po::value<std::string>(&output_fname), "output file")
-	;
+protected:
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+		off_type base = dir == std::ios_base::beg ? 0 : dir == std::ios_base::cur ? gptr() - eback() : egptr() - eback();
+		off_type pos = base + off;
+		if (!(which & std::ios_base::in) || pos < 0 || pos > egptr() - eback())
+			return pos_type(off_type(-1));
+		setg(eback(), eback() + pos, egptr());
+		return pos_type(pos);
+	}
 
-	po::variables_map vm;
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+		return seekoff(off_type(pos), std::ios_base::beg, which);
+	}
+};
 
-	try {
-		po::store(po::parse_command_line(argc, argv, desc), vm);
-		po::notify(vm);
+bool encode(const std::string & in_fname, const std::string & out_fname, Header header, CodecStats * stats, CodecContext * context) {
+	if (!context) {
+		CodecContext ctx;
+		return encode(in_fname, out_fname, header, stats, &ctx);
 	}
-	catch (const po::error & u) {
-		std::cout << u.what() << "\n";
-		return 0;
+
+	CodecContext & ctx = *context;
+	cv::Mat img;
+
+	{
+		ScopedTimer timer(stage(stats, &StageTimes::read));
+		// raw mosaic is coded as it is, other conversions start from color image
+		int flags = header.conversion == 4 ? CV_LOAD_IMAGE_GRAYSCALE : CV_LOAD_IMAGE_COLOR;
+		img = cv::imread(in_fname.c_str(), CV_LOAD_IMAGE_ANYDEPTH | flags);
 	}
 
-	if (vm.count("help") || argc < 2) {
-		std::cout << desc << "\n";
-		return 0;
+	if (img.empty()) {
+		std::cout << "Can't load image from file: " << in_fname << std::endl;
+		return false;
 	}
 
-	if (input_fname == "") {
-		std::cout << "No input file specified.\n";
-		return 0;
+	header.depth = imageDepth(img);
+	if (header.depth == 0) {
+		std::cout << "Unsupported image depth (only 8 and 16-bit): " << in_fname << std::endl;
+		return false;
+	}
+
+	if (header.depth > 8 && (header.conversion == 2 || header.conversion == 3)) {
+		std::cout << "HSV and Bayer conversions need 8-bit image: " << in_fname << std::endl;
+		return false;
+	}
+
+	if (header.depth > 12 && header.conversion == 5) {
+		std::cout << "YCoCg conversion needs image of up to 12 bits: " << in_fname << std::endl;
+		return false;
+	}
+
+	if (header.conversion == 0) {
+		ScopedTimer timer(stage(stats, &StageTimes::search));
+		header = autoHeader(img, header, &ctx);
+	}
+
+	std::ofstream f(out_fname.c_str(), std::ios_base::out | std::ios_base::binary);
+
+	std::vector<cv::Mat> & channels = ctx.channels;
+
+	{
+		ScopedTimer timer(stage(stats, &StageTimes::split));
+		splitChannels(img, header.conversion, header.depth, channels, ctx);
+	}
+
+	header.channels = channels.size();
+	ctx.residuals.resize(header.channels);
+
+	if (header.psnr > 0) {
+		ScopedTimer timer(stage(stats, &StageTimes::search));
+		header = lossyPlanes(channels, header);
+	}
+
+	if (stats)
+		stats->bytes_in += (int64_t)img.size().width * img.size().height * img.elemSize();
+
+	{
+		ScopedTimer timer(stage(stats, &StageTimes::write));
+		writeHeader(f, header);
+	}
+
+	// encode bitplanes straight from the gray coded channel
+	for (int i = 0; i < header.channels; ++i) {
+		std::vector<cv::Mat> & residuals = ctx.residuals[i];
+		int candidates = channelResiduals(channels[i], header.gray, header.exor, stats, residuals);
+
+		// planes below the kept ones aren't stored at all
+		for (int p = channelDepth(header, i) - keptPlanes(header, i); p < channelDepth(header, i); ++p) {
+			RleBuffer & buf = ctx.buf;
+			PlaneStats plane_stats;
+			std::streamoff record_start = f.tellp();
+
+			{
+				ScopedTimer timer(stage(stats, &StageTimes::rle));
+
+				int mode, bestk;
+				RleCodebook codebook(0);
+				int bytes = choosePlaneCoding(residuals, candidates, p, mode, codebook, bestk, ctx);
+				bytes = fitPlaneCodebook(mode, codebook, bestk, bytes, ctx);
+				codePlane(mode, codebook, bestk, bytes, ctx, buf);
+				if (buf.failed()) {
+					std::cout << "Can't code plane " << p << " of channel " << i << ": " << in_fname << std::endl;
+					return false;
+				}
+
+				plane_stats.mode = mode;
+				plane_stats.predictor = bestk;
+				plane_stats.type = codebook.getType();
+			}
+
+			PlaneRecord & record = ctx.record;
+			record.channel = i;
+			record.plane = p;
+			record.flags = 0;
+
+			{
+				RecordWriter writer(record.data);
+				std::ostream out(&writer);
+				buf.saveToFile(out);
+			}
+
+			if (header.post == 1) {
+				ScopedTimer timer(stage(stats, &StageTimes::huffman));
+				int codes;
+				{
+					RecordReader reader(record.data);
+					std::istream in(&reader);
+					RecordWriter writer(ctx.coded);
+					std::ostream out(&writer);
+					codes = enchuf(in, out);
+				}
+
+				// records are Huffman coded only if it makes them smaller
+				if (ctx.coded.size() < record.data.size()) {
+					record.data.swap(ctx.coded);
+					record.flags |= RECORD_HUFFMAN;
+					plane_stats.huffman_codes = codes;
+				}
+			}
+
+			{
+				ScopedTimer timer(stage(stats, &StageTimes::write));
+				writeRecord(f, record, header.crc);
+			}
+
+			if (stats) {
+				plane_stats.channel = i;
+				plane_stats.plane = p;
+				plane_stats.runs = buf.runs();
+				plane_stats.rle_bytes = buf.size();
+				plane_stats.coded_bytes = f.tellp() - record_start;
+				stats->runs += plane_stats.runs;
+				stats->planes.push_back(plane_stats);
+			}
+		}
+	}
+
+	if (stats)
+		stats->bytes_out += f.tellp();
+
+	{
+		ScopedTimer timer(stage(stats, &StageTimes::write));
+		f.close();
+	}
+
+	return true;
+}
+
+/*!
+ * Checks header fields read from file, so that decoding never needs more
+ * planes or channels than there is room for.
+ */
+static bool validHeader(const Header & header) {
+	if (header.channels < 1 || header.channels > MAX_CHANNELS)
+		return false;
+	if (header.conversion < 1 || header.conversion > 5)
+		return false;
+	if (header.depth < 1 || channelDepth(header, header.channels - 1) > MAX_DEPTH)
+		return false;
+
+	switch (header.conversion) {
+	case 2:
+		return header.channels == 3 && header.depth == 8;
+	case 3:
+		return header.channels == 3 && header.depth == 8;
+	case 4:
+		return header.channels == 4;
+	case 5:
+		// chroma has one plane more and is decoded to 16-bit channels
+		return (header.channels == 1 || header.channels == 3) && header.depth >= 8 && header.depth <= 12;
+	default:
+		return true;
+	}
+}
+
+/*!
+ * Checks that decoded channels have sizes the conversion can merge.
+ */
+static bool channelsFit(const Header & header, const std::vector<cv::Mat> & channels) {
+	if (header.conversion == 4) {
+		cv::Size s0 = channels[0].size(), s1 = channels[1].size();
+		cv::Size s2 = channels[2].size(), s3 = channels[3].size();
+		return s0.width == s2.width && s1.width == s3.width && s0.height == s1.height && s2.height == s3.height
+				&& (s0.width == s1.width || s0.width == s1.width + 1)
+				&& (s0.height == s2.height || s0.height == s2.height + 1);
 	}
 
-	if (output_fname == "") {
-		output_fname = input_fname + ".rle";
+	if (header.conversion == 3) {
+		int width = channels[0].size().width + channels[2].size().width;
+		int height = channels[1].size().height;
+		return channels[0].size() == cv::Size((width + 1) / 2, (height + 1) / 2)
+				&& channels[1].size() == cv::Size((width + 1) / 2, height)
+				&& channels[2].size() == cv::Size(width / 2, height / 2);
 	}
 
+	for (size_t i = 1; i < channels.size(); ++i)
+		if (channels[i].size() != channels[0].size())
+			return false;
+	return true;
+}
+
+bool decode(const std::string & in_fname, const std::string & out_fname, CodecStats * stats, CodecContext * context) {
+	if (!context) {
+		CodecContext ctx;
+		return decode(in_fname, out_fname, stats, &ctx);
+	}
+
+	CodecContext & ctx = *context;
 	Header header;
-	if (vm.count("gray")) {
-		header.gray = 1;
-	} else {
-		header.gray = 0;
+	cv::Mat & tmp = ctx.image;
+
+	std::ifstream f(in_fname.c_str(), std::ios_base::in | std::ios_base::binary);
+
+	std::vector<cv::Mat> & channels = ctx.channels;
+
+	{
+		ScopedTimer timer(stage(stats, &StageTimes::read));
+		if (!readHeader(f, header) || !validHeader(header)) {
+			std::cout << "Can't decode file: " << in_fname << std::endl;
+			return false;
+		}
 	}
 
-	if (vm.count("xor")) {
-		header.exor = 1;
-	} else {
-		header.exor = 0;
+	channels.resize(header.channels);
+	ctx.planes.resize(header.channels);
+
+	for (int i = 0; i < header.channels; ++i) {
+		// planes below the kept ones stay as they were, they aren't read
+		std::vector<PackedPlane> & planes = ctx.planes[i];
+		int lowest = channelDepth(header, i) - keptPlanes(header, i);
+		planes.resize(channelDepth(header, i));
+
+		for (int p = lowest; p < channelDepth(header, i); ++p) {
+			RleBuffer & buf = ctx.buf;
+			PlaneStats plane_stats;
+			std::streamoff record_start = f.tellg();
+
+			PlaneRecord & record = ctx.record;
+			bool ok;
+			{
+				ScopedTimer timer(stage(stats, &StageTimes::read));
+				ok = readRecord(f, record, header.crc);
+			}
+
+			if (!ok || record.channel != i || record.plane != p) {
+				std::cout << "Corrupted record of channel " << i << " plane " << p << ": " << in_fname << std::endl;
+				return false;
+			}
+
+			if (record.flags & RECORD_HUFFMAN) {
+				ScopedTimer timer(stage(stats, &StageTimes::huffman));
+				{
+					RecordReader reader(record.data);
+					std::istream in(&reader);
+					RecordWriter writer(ctx.coded);
+					std::ostream out(&writer);
+					plane_stats.huffman_codes = dechuf(in, out);
+				}
+				RecordReader reader(ctx.coded);
+				std::istream in(&reader);
+				ok = plane_stats.huffman_codes >= 0 && buf.loadFromFile(in);
+			} else {
+				ScopedTimer timer(stage(stats, &StageTimes::rle));
+				RecordReader reader(record.data);
+				std::istream in(&reader);
+				ok = buf.loadFromFile(in);
+			}
+
+			// planes of one channel must be alike
+			if (ok && p > lowest)
+				ok = buf.getWidth() == planes[p - 1].width && buf.getHeight() == planes[p - 1].height;
+
+			if (!ok) {
+				std::cout << "Corrupted record of channel " << i << " plane " << p << ": " << in_fname << std::endl;
+				return false;
+			}
+
+			if (stats) {
+				plane_stats.channel = i;
+				plane_stats.plane = p;
+				plane_stats.coded_bytes = f.tellg() - record_start;
+				plane_stats.rle_bytes = buf.size();
+			}
+
+			{
+				ScopedTimer timer(stage(stats, &StageTimes::rle));
+				if (buf.getMode() == PLANE_RAW)
+					ok = buf.getRaw(planes[p]);
+				else
+					ok = (plane_stats.runs = rle(buf, planes[p], ctx.changes)) >= 0;
+			}
+
+			if (!ok) {
+				std::cout << "Corrupted record of channel " << i << " plane " << p << ": " << in_fname << std::endl;
+				return false;
+			}
+
+			{
+				ScopedTimer timer(stage(stats, &StageTimes::exor));
+				unpredict(planes[p], buf.getPredictor());
+			}
+
+			if (stats) {
+				plane_stats.mode = buf.getMode();
+				plane_stats.predictor = buf.getPredictor();
+				plane_stats.type = buf.getType();
+				stats->runs += plane_stats.runs;
+				stats->planes.push_back(plane_stats);
+			}
+		}
+
+		ScopedTimer timer(stage(stats, &StageTimes::gray));
+		decodeChannel(planes, header.gray, keptPlanes(header, i), channels[i]);
 	}
 
-	if (vm.count("huffman")) {
-		header.post = 1;
-	} else {
-		header.post = 0;
+	if (!channelsFit(header, channels)) {
+		std::cout << "Channel sizes don't match: " << in_fname << std::endl;
+		return false;
 	}
 
-	if (conversion == "RGB") {
-		header.conversion = 1;
-	} else
-	if (conversion == "HSV") {
-		header.conversion = 2;
-	} else
-	if (conversion == "Bayer") {
-		header.conversion = 3;
-	} else {
-		std::cout << "Unknown conversion: " << conversion << "\n";
-		return 0;
+	{
+		ScopedTimer timer(stage(stats, &StageTimes::split));
+
+		if (header.conversion == 5 && channels.size() > 1) {
+			ycocgMerge(channels, header.depth, tmp, ctx.bgr);
+		} else if (header.conversion == 4) {
+			mosaicMerge(channels, tmp);
+		} else if (header.conversion == 3) {
+			bayerMerge(channels, ctx.converted);
+			cv::cvtColor(ctx.converted, tmp, CV_BayerBG2BGR);
+		} else if (header.conversion == 2) {
+			cv::merge(channels, ctx.converted);
+			cv::cvtColor(ctx.converted, tmp, CV_HSV2BGR);
+		} else {
+			cv::merge(channels, tmp);
+		}
 	}
 
+	if (tmp.empty()) {
+		std::cout << "Can't merge decoded channels: " << in_fname << std::endl;
+		return false;
+	}
 
-	if (vm.count("decode")) {
-		decode(input_fname, output_fname);
-	} else {
-		encode(input_fname, output_fname, header);
+	if (stats) {
+		stats->bytes_in += f.tellg();
+		stats->bytes_out += (int64_t)tmp.size().width * tmp.size().height * tmp.elemSize();
 	}
 
-	return 0;
+	ScopedTimer timer(stage(stats, &StageTimes::write));
+	cv::imwrite(out_fname.c_str(), tmp);
+
+	return true;
 }
@@ -0,0 +1,1653 @@
+/*!
+ * \file
+ * \brief Bit plane RLE image codec
+ */
+
+#ifndef _CODEC_H_INCLUDED_
+#define _CODEC_H_INCLUDED_
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+
+#include <cv.h>
+
+// ===============================================================================================
+//
+// Bit-wise splitting and merging
+//
+// ===============================================================================================
+
+// most bit planes per channel (16-bit images)
+static const int MAX_DEPTH = 16;
+
+cv::Mat getBitPlane(const cv::Mat & img, int plane);
+cv::Mat mergeBitPlanes(const std::vector<cv::Mat> & planes);
+
+// ===============================================================================================
+//
+// Packed bit planes
+//
+// ===============================================================================================
+
+/*!
+ * Bit plane stored one bit per pixel. Pixel x of row y is bit x % 64 of word
+ * x / 64 of that row, every row starts at a word boundary. Padding bits past
+ * the row width are undefined.
+ */
+struct PackedPlane {
+	PackedPlane(int w = 0, int h = 0) : width(w), height(h), stride((w + 63) / 64), words((size_t)stride * h, 0) {}
+
+	/*!
+	 * Resizes to \a w x \a h cleared plane, reusing storage when it is large enough.
+	 */
+	void reset(int w, int h) {
+		width = w;
+		height = h;
+		stride = (w + 63) / 64;
+		words.assign((size_t)stride * h, 0);
+	}
+
+	uint64_t * row(int y) {
+		return words.data() + (size_t)y * stride;
+	}
+
+	const uint64_t * row(int y) const {
+		return words.data() + (size_t)y * stride;
+	}
+
+	int width;
+	int height;
+	int stride;
+	std::vector<uint64_t> words;
+};
+
+/*!
+ * Packs bit \a plane of every pixel of 8 or 16-bit \a img.
+ */
+PackedPlane packPlane(const cv::Mat & img, int plane);
+void packPlane(const cv::Mat & img, int plane, PackedPlane & result);
+
+// ===============================================================================================
+//
+// NKB2GRAY
+//
+// ===============================================================================================
+
+cv::Mat nkb2gray(const cv::Mat & img, bool reverse = false);
+
+// ===============================================================================================
+//
+// Fused channel transforms
+//
+// ===============================================================================================
+
+/*!
+ * Bit plane predictors. Every plane is stored as XOR of the pixel and its
+ * prediction, computed from already coded neighbours (outside of the image
+ * neighbours are 0).
+ */
+enum Predictor {
+	PRED_NONE = 0,		// plane stored as is
+	PRED_LEFT = 1,		// left neighbour
+	PRED_UP = 2,		// upper neighbour
+	PRED_MAJORITY = 3,	// majority of left, upper and upper-left neighbours
+	PREDICTORS
+};
+
+cv::Mat encodeChannel(const cv::Mat & img, bool gray);
+cv::Mat predictChannel(const cv::Mat & img, const std::vector<int> & predictors);
+cv::Mat decodeChannel(const std::vector<PackedPlane> & planes, bool gray, int kept = 8);
+
+// variants writing into \a result, which keeps its data if it already has the right size and type
+void encodeChannel(const cv::Mat & img, bool gray, cv::Mat & result);
+void predictChannel(const cv::Mat & img, const std::vector<int> & predictors, cv::Mat & result);
+void decodeChannel(const std::vector<PackedPlane> & planes, bool gray, int kept, cv::Mat & result);
+
+// ===============================================================================================
+//
+// RLE
+//
+// ===============================================================================================
+
+/*!
+ * How plane record payload is stored.
+ */
+enum PlaneMode {
+	PLANE_RLE = 0,		// run lengths coded with codebook of given type
+	PLANE_RAW = 1,		// packed bits, PackedPlane words (for noise-like planes)
+	PLANE_HUFFMAN = 2,	// run length classes Huffman coded, see RunCode
+	PLANE_READ = 3		// rows coded against the row above, see ReadMode
+};
+
+/*!
+ * Writes lowest \a bytes bytes of \a v, least significant first.
+ */
+inline void writeLE(std::ostream & f, uint64_t v, int bytes) {
+	char buf[8];
+	for (int i = 0; i < bytes; ++i)
+		buf[i] = (char)(v >> (8 * i));
+	f.write(buf, bytes);
+}
+
+/*!
+ * Reads \a bytes bytes written by writeLE(), 0 if the stream ends.
+ */
+inline uint64_t readLE(std::istream & f, int bytes) {
+	unsigned char buf[8] = {0};
+	f.read((char*)buf, bytes);
+	uint64_t v = 0;
+	for (int i = 0; i < bytes; ++i)
+		v |= (uint64_t)buf[i] << (8 * i);
+	return f ? v : 0;
+}
+
+/*!
+ * Writes (reads) \a n 32-bit words, little-endian.
+ */
+inline void writeWordsLE(std::ostream & f, const uint32_t * words, size_t n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	f.write((const char*)words, n * sizeof(uint32_t));
+#else
+	for (size_t i = 0; i < n; ++i)
+		writeLE(f, words[i], 4);
+#endif
+}
+
+inline void readWordsLE(std::istream & f, uint32_t * words, size_t n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	f.read((char*)words, n * sizeof(uint32_t));
+#else
+	for (size_t i = 0; i < n; ++i)
+		words[i] = readLE(f, 4);
+#endif
+}
+
+/*!
+ * Plane record header. Stored little-endian, field by field: first_symbol (1
+ * byte), width (2), height (2), type (1), predictor (1), mode (1), interval
+ * lengths (7, adaptive codebook only), followed by number of 32-bit words (4)
+ * and the words.
+ */
+struct RLEHeader {
+	uint8_t first_symbol;
+	uint16_t width;
+	uint16_t height;
+	uint8_t type;
+	// Predictor the plane was coded with
+	uint8_t predictor;
+	// PlaneMode of the payload
+	uint8_t mode;
+};
+
+/*!
+ * Run length code: unary prefix of 1 to 7 bits selects one of 7 intervals and
+ * data_len bits that follow select the run within it. Types 0-5 have fixed
+ * interval lengths, ADAPTIVE codebooks are fitted to a plane by
+ * RunHistogram::fit() and their lengths are stored in the plane header.
+ */
+struct RleCodebook {
+	static const int ADAPTIVE = 6;
+	// longest interval, so that prefix and data fit in 32 bits
+	static const int MAX_DATA_LEN = 25;
+
+	RleCodebook(int type) : INTERVALS(7), m_type(type) {
+		setPrefixes();
+
+		if (type == 0) {
+			data_len[0] = 0;
+			data_len[1] = 1;
+			data_len[2] = 2;
+			data_len[3] = 3;
+			data_len[4] = 4;
+			data_len[5] = 10;
+			data_len[6] = 25;
+		} else if (type == 1) {
+			data_len[0] = 0;
+			data_len[1] = 0;
+			data_len[2] = 1;
+			data_len[3] = 2;
+			data_len[4] = 4;
+			data_len[5] = 10;
+			data_len[6] = 25;
+		} else if (type == 2) {
+			data_len[0] = 1;
+			data_len[1] = 2;
+			data_len[2] = 3;
+			data_len[3] = 4;
+			data_len[4] = 5;
+			data_len[5] = 10;
+			data_len[6] = 25;
+		} else if (type == 3) {
+			data_len[0] = 1;
+			data_len[1] = 3;
+			data_len[2] = 5;
+			data_len[3] = 7;
+			data_len[4] = 9;
+			data_len[5] = 11;
+			data_len[6] = 25;
+		} else if (type == 4) {
+			data_len[0] = 2;
+			data_len[1] = 3;
+			data_len[2] = 4;
+			data_len[3] = 5;
+			data_len[4] = 6;
+			data_len[5] = 7;
+			data_len[6] = 25;
+		} else if (type == 5) {
+			data_len[0] = 1;
+			data_len[1] = 4;
+			data_len[2] = 5;
+			data_len[3] = 6;
+			data_len[4] = 7;
+			data_len[5] = 8;
+			data_len[6] = 25;
+		}
+
+		setIntervals();
+	}
+
+	/*!
+	 * ADAPTIVE codebook with interval lengths \a lengths.
+	 */
+	RleCodebook(const int * lengths) : INTERVALS(7), m_type(ADAPTIVE) {
+		setPrefixes();
+		std::copy(lengths, lengths + 7, data_len);
+		setIntervals();
+	}
+
+	int prefixes[7];
+	int pref_msk[7];
+	int pref_res[7];
+	int pref_len[7];
+	int data_len[7];
+	int data_msk[7];
+	int data_min[7];
+	int data_max[7];
+
+	// interval of prefix starting the byte, INTERVALS if the byte has no prefix
+	uint8_t interval[256];
+
+	int INTERVALS;
+
+	int getType() const {
+		return m_type;
+	}
+
+	/*!
+	 * Number of bits needed to code run of given length, 0 if it is longer
+	 * than maxLength().
+	 */
+	int bits(int len) const {
+		for (int i = 0; i < INTERVALS; ++i)
+			if (len <= data_max[i])
+				return pref_len[i] + data_len[i];
+		return 0;
+	}
+
+	/*!
+	 * Longest run the codebook can code.
+	 */
+	int maxLength() const {
+		return data_max[INTERVALS - 1];
+	}
+
+private:
+	void setPrefixes() {
+		prefixes[0] = 0x00;
+		prefixes[1] = 0x02;
+		prefixes[2] = 0x06;
+		prefixes[3] = 0x0E;
+		prefixes[4] = 0x1E;
+		prefixes[5] = 0x3E;
+		prefixes[6] = 0x7E;
+
+		pref_msk[0] = 0x80;
+		pref_msk[1] = 0xC0;
+		pref_msk[2] = 0xE0;
+		pref_msk[3] = 0xF0;
+		pref_msk[4] = 0xF8;
+		pref_msk[5] = 0xFC;
+		pref_msk[6] = 0xFE;
+
+		pref_res[0] = 0x00;
+		pref_res[1] = 0x80;
+		pref_res[2] = 0xC0;
+		pref_res[3] = 0xE0;
+		pref_res[4] = 0xF0;
+		pref_res[5] = 0xF8;
+		pref_res[6] = 0xFc;
+
+		pref_len[0] = 1;
+		pref_len[1] = 2;
+		pref_len[2] = 3;
+		pref_len[3] = 4;
+		pref_len[4] = 5;
+		pref_len[5] = 6;
+		pref_len[6] = 7;
+
+		for (int b = 0; b < 256; ++b) {
+			interval[b] = INTERVALS;
+			for (int i = 0; i < INTERVALS; ++i)
+				if ((b & pref_msk[i]) == pref_res[i]) {
+					interval[b] = i;
+					break;
+				}
+		}
+	}
+
+	void setIntervals() {
+		int last = 0;
+		for (int i = 0; i < 7; ++i) {
+			int range = 1 << data_len[i];
+			data_msk[i] = (1 << data_len[i]) - 1;
+			data_min[i] = last+1;
+			data_max[i] = last + range;
+			last = data_max[i];
+		}
+	}
+
+	int m_type;
+};
+
+/*!
+ * Number of run length classes. As in DEFLATE length codes, run of length n is
+ * coded by class of n - 1: values below 4 have a class each, larger ones are
+ * classed by their two highest bits and the bits below follow the class code
+ * as they are.
+ */
+static const int RUN_CLASSES = 64;
+
+/*!
+ * Class of run \a len, its extra bits are returned in \a extra (\a extra_len
+ * of them).
+ */
+inline int runClass(uint32_t len, int & extra_len, uint32_t & extra) {
+	uint32_t v = len - 1;
+	if (v < 4) {
+		extra_len = 0;
+		extra = 0;
+		return v;
+	}
+
+#if defined(__GNUC__)
+	int b = 31 - __builtin_clz(v);
+#else
+	int b = 0;
+	while (v >> (b + 1))
+		++b;
+#endif
+	extra_len = b - 1;
+	extra = v & ((1u << extra_len) - 1);
+	return 2 * b + ((v >> extra_len) & 1);
+}
+
+/*!
+ * Number of extra bits following class \a c.
+ */
+inline int runExtraBits(int c) {
+	return c < 4 ? 0 : c / 2 - 1;
+}
+
+/*!
+ * Run length of class \a c with extra bits \a extra.
+ */
+inline uint64_t runLength(int c, uint32_t extra) {
+	if (c < 4)
+		return c + 1;
+	return ((uint64_t)(2 | (c & 1)) << runExtraBits(c) | extra) + 1;
+}
+
+/*!
+ * Canonical Huffman code of run length classes, codes are at most MAX_LENGTH
+ * bits long so that one table lookup decodes any of them.
+ */
+struct RunCode {
+	static const int MAX_LENGTH = 12;
+
+	RunCode() {
+		std::fill(lengths, lengths + RUN_CLASSES, 0);
+		std::fill(codes, codes + RUN_CLASSES, 0);
+	}
+
+	/*!
+	 * Sets code lengths for classes occurring \a counts times and assigns codes.
+	 */
+	void build(const uint32_t * counts);
+
+	/*!
+	 * Assigns canonical codes to lengths, false if they don't form a prefix code.
+	 */
+	bool assign();
+
+	/*!
+	 * Fills decoding table, codes must be assigned.
+	 */
+	void buildTable();
+
+	/*!
+	 * Number of classes up to the last one with a code.
+	 */
+	int classes() const {
+		int n = RUN_CLASSES;
+		while (n > 0 && lengths[n - 1] == 0)
+			--n;
+		return n;
+	}
+
+	/*!
+	 * Bits needed to store the code itself: number of classes and their lengths.
+	 */
+	int tableBits() const {
+		return 7 + 4 * classes();
+	}
+
+	uint8_t lengths[RUN_CLASSES];
+	uint16_t codes[RUN_CLASSES];
+	// (class << 4) | code length indexed by next MAX_LENGTH bits, 0 if no code matches
+	std::vector<uint16_t> table;
+};
+
+/*!
+ * PLANE_READ codes, as in two-dimensional coding of CCITT T.6 (G4). Vertical
+ * modes place the next change of colour in the row up to 3 pixels left or right
+ * of the matching change in the row above, pass mode skips a pair of changes
+ * above and horizontal mode is followed by two run lengths coded with the
+ * plane codebook.
+ */
+enum ReadMode {
+	READ_VL3 = 0,
+	READ_VL2,
+	READ_VL1,
+	READ_V0,
+	READ_VR1,
+	READ_VR2,
+	READ_VR3,
+	READ_HORIZONTAL,
+	READ_PASS,
+	READ_MODES
+};
+
+// code and code length of every ReadMode
+static const uint8_t READ_CODES[READ_MODES][2] = {
+	{0x02, 7}, {0x02, 6}, {0x02, 3}, {0x01, 1}, {0x03, 3}, {0x03, 6}, {0x03, 7},
+	{0x01, 3}, {0x01, 4}
+};
+
+/*!
+ * Decoding table of ReadMode codes.
+ */
+struct ReadModeTable {
+	static const int BITS = 7;
+
+	ReadModeTable() {
+		std::fill(entries, entries + (1 << BITS), 0);
+		for (int m = 0; m < READ_MODES; ++m) {
+			int shift = BITS - READ_CODES[m][1];
+			std::fill(entries + (READ_CODES[m][0] << shift), entries + ((READ_CODES[m][0] + 1) << shift), m << 3 | READ_CODES[m][1]);
+		}
+	}
+
+	// (mode << 3) | code length indexed by next BITS bits, 0 if no code matches
+	uint8_t entries[1 << BITS];
+};
+
+class RleBuffer {
+public:
+	RleBuffer(RleCodebook cb = RleCodebook(0), int w = 0, int h = 0) : codebook(cb) {
+		reset(cb, w, h);
+	}
+
+	/*!
+	 * Starts new empty stream, as if constructed anew, but keeps storage of
+	 * the previous one.
+	 */
+	void reset(const RleCodebook & cb, int w, int h) {
+		m_words = 0;
+		m_tmp = 0;
+		m_tmp_size = 0;
+		m_runs = 0;
+		m_failed = false;
+		m_read_pos = 0;
+		m_read_buf = 0;
+		m_read_size = 0;
+		m_color = 0;
+		codebook = cb;
+
+		m_header.first_symbol = 0;
+		m_header.width = w;
+		m_header.height = h;
+		m_header.type = cb.getType();
+		m_header.predictor = PRED_NONE;
+		m_header.mode = PLANE_RLE;
+	}
+
+	uint8_t getMode() {
+		return m_header.mode;
+	}
+
+	/*!
+	 * Makes room for stream of \a bytes, so that words are written without
+	 * reallocation while it stays within that size. Storage only grows, it
+	 * is kept by reset().
+	 */
+	void reserve(size_t bytes) {
+		size_t words = (bytes + 3) / 4;
+		if (m_buffer.size() < words)
+			m_buffer.resize(words);
+	}
+
+	/*!
+	 * Upper bound of size() of \a w x \a h plane coded with \a cb: every run
+	 * covers at least one pixel and no run costs more bits per pixel than the
+	 * shortest one of the costliest interval.
+	 */
+	static size_t maxSize(const RleCodebook & cb, int w, int h) {
+		uint64_t pixels = (uint64_t)w * h;
+		uint64_t bits = 0;
+		for (int i = 0; i < cb.INTERVALS; ++i) {
+			uint64_t cost = cb.pref_len[i] + cb.data_len[i];
+			bits = std::max(bits, (pixels * cost + cb.data_min[i] - 1) / cb.data_min[i]);
+		}
+		return ((bits + 31) / 32) * 4;
+	}
+
+	/*!
+	 * Stores \a plane as raw packed bits instead of runs.
+	 */
+	void setRaw(const PackedPlane & plane) {
+		m_header.mode = PLANE_RAW;
+		m_header.predictor = PRED_NONE;
+		m_header.width = plane.width;
+		m_header.height = plane.height;
+		reserve(plane.words.size() * 8);
+		m_words = plane.words.size() * 2;
+		for (size_t i = 0; i < plane.words.size(); ++i) {
+			m_buffer[2 * i] = (uint32_t)plane.words[i];
+			m_buffer[2 * i + 1] = (uint32_t)(plane.words[i] >> 32);
+		}
+	}
+
+	/*!
+	 * Retrieves plane stored with setRaw(), false if the buffer doesn't match
+	 * plane size.
+	 */
+	bool getRaw(PackedPlane & plane) {
+		plane.reset(m_header.width, m_header.height);
+		if (m_words != plane.words.size() * 2)
+			return false;
+		for (size_t i = 0; i < plane.words.size(); ++i)
+			plane.words[i] = m_buffer[2 * i] | (uint64_t)m_buffer[2 * i + 1] << 32;
+		return true;
+	}
+
+	/*!
+	 * Switches to PLANE_HUFFMAN mode: runs of the first symbol are coded with
+	 * \a first, the others with \a second. Both codes are stored at the start of
+	 * the stream, so this must precede add().
+	 */
+	void setRunCodes(const RunCode & first, const RunCode & second) {
+		m_header.mode = PLANE_HUFFMAN;
+		m_header.type = 0;
+		m_run_codes[0] = first;
+		m_run_codes[1] = second;
+		m_color = 0;
+
+		for (int k = 0; k < 2; ++k) {
+			int n = m_run_codes[k].classes();
+			addSymbol(n, 7);
+			for (int c = 0; c < n; ++c)
+				addSymbol(m_run_codes[k].lengths[c], 4);
+		}
+	}
+
+	/*!
+	 * Switches to PLANE_READ mode, codes are then added with addMode() and
+	 * run lengths of horizontal mode with add().
+	 */
+	void setRead() {
+		m_header.mode = PLANE_READ;
+		m_header.first_symbol = 0;
+	}
+
+	RleBuffer & addMode(int mode) {
+		addSymbol(READ_CODES[mode][0], READ_CODES[mode][1]);
+		return *this;
+	}
+
+	/*!
+	 * Size of record stored raw (in bytes, as size()).
+	 */
+	static int rawSize(int width, int height) {
+		return ((width + 63) / 64) * height * 8;
+	}
+
+	void setPredictor(uint8_t p) {
+		m_header.predictor = p;
+	}
+
+	uint8_t getPredictor() {
+		return m_header.predictor;
+	}
+
+	void setFirstSymbol(uint8_t s) {
+		m_header.first_symbol = s;
+	}
+
+	uint8_t getFirstSymbol() {
+		return m_header.first_symbol;
+	}
+
+	uint16_t getWidth() {
+		return m_header.width;
+	}
+
+	uint16_t getHeight() {
+		return m_header.height;
+	}
+
+	uint8_t getType() {
+		return m_header.type;
+	}
+
+	void saveToFile(const std::string & filename) {
+		std::ofstream f(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+		saveToFile(f);
+	}
+
+	bool loadFromFile(const std::string & filename) {
+		std::ifstream f(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+		return loadFromFile(f);
+	}
+
+	void saveToFile(std::ostream & f) {
+		writeLE(f, m_header.first_symbol, 1);
+		writeLE(f, m_header.width, 2);
+		writeLE(f, m_header.height, 2);
+		writeLE(f, m_header.type, 1);
+		writeLE(f, m_header.predictor, 1);
+		writeLE(f, m_header.mode, 1);
+		if (m_header.type == RleCodebook::ADAPTIVE)
+			for (int i = 0; i < codebook.INTERVALS; ++i)
+				writeLE(f, codebook.data_len[i], 1);
+		writeLE(f, m_words, 4);
+		writeWordsLE(f, m_buffer.data(), m_words);
+	}
+
+	/*!
+	 * Loads record saved by saveToFile(), false if it is truncated or its
+	 * fields are out of range.
+	 */
+	bool loadFromFile(std::istream & f) {
+		m_header.first_symbol = readLE(f, 1);
+		m_header.width = readLE(f, 2);
+		m_header.height = readLE(f, 2);
+		m_header.type = readLE(f, 1);
+		m_header.predictor = readLE(f, 1);
+		m_header.mode = readLE(f, 1);
+
+		if (!f || m_header.type > RleCodebook::ADAPTIVE || m_header.predictor >= PREDICTORS || m_header.mode > PLANE_READ)
+			return false;
+
+		if (m_header.type == RleCodebook::ADAPTIVE) {
+			int lengths[7];
+			for (int i = 0; i < 7; ++i) {
+				lengths[i] = readLE(f, 1);
+				if (lengths[i] > RleCodebook::MAX_DATA_LEN)
+					return false;
+			}
+			codebook = RleCodebook(lengths);
+		} else {
+			codebook = RleCodebook(m_header.type);
+		}
+
+		uint32_t words = readLE(f, 4);
+		if (!f)
+			return false;
+
+		// don't trust the count before seeing there is that much data
+		std::streampos pos = f.tellg();
+		f.seekg(0, std::ios::end);
+		std::streamoff left = f.tellg() - pos;
+		f.seekg(pos);
+		if (left < (std::streamoff)words * 4)
+			return false;
+
+		reserve((size_t)words * 4);
+		m_words = words;
+		readWordsLE(f, m_buffer.data(), m_words);
+		m_read_pos = 0;
+		m_read_buf = 0;
+		m_read_size = 0;
+		m_color = 0;
+
+		if (!f)
+			return false;
+		return m_header.mode != PLANE_HUFFMAN || readRunCodes();
+	}
+
+	/*!
+	 * Decodes next run length, 0 if the stream ended or holds invalid prefix.
+	 */
+	int getNextLength() {
+		if (m_header.mode == PLANE_HUFFMAN)
+			return getNextClassLength();
+
+		fillRead();
+
+		int i = codebook.interval[m_read_buf >> 56];
+		if (i == codebook.INTERVALS)
+			return 0;
+
+		int bits = codebook.data_len[i] + codebook.pref_len[i];
+		// fillRead() keeps at least 32 bits while there are any left
+		if (bits > m_read_size)
+			return 0;
+
+		uint32_t data = (m_read_buf >> (64 - bits)) & codebook.data_msk[i];
+		m_read_buf <<= bits;
+		m_read_size -= bits;
+
+		return data + codebook.data_min[i];
+	}
+
+	/*!
+	 * Decodes next ReadMode of PLANE_READ stream, -1 if the stream ended or
+	 * holds invalid code.
+	 */
+	int getNextMode() {
+		static const ReadModeTable table;
+
+		fillRead();
+
+		uint8_t entry = table.entries[m_read_buf >> (64 - ReadModeTable::BITS)];
+		int len = entry & 7;
+		if (len == 0 || len > m_read_size)
+			return -1;
+		m_read_buf <<= len;
+		m_read_size -= len;
+
+		return entry >> 3;
+	}
+
+	/*!
+	 * Codes run of \a len pixels. Run longer than the codebook can code is
+	 * not stored and marks the stream as failed().
+	 */
+	RleBuffer & add(int len) {
+		int i;
+
+		m_runs++;
+
+		if (m_header.mode == PLANE_HUFFMAN) {
+			int extra_len;
+			uint32_t extra;
+			int c = runClass(len, extra_len, extra);
+			addSymbol(m_run_codes[m_color].codes[c], m_run_codes[m_color].lengths[c]);
+			addSymbol(extra, extra_len);
+			m_color ^= 1;
+			return *this;
+		}
+
+		for (i = 0; i < codebook.INTERVALS; ++i) {
+			if (len <= codebook.data_max[i]) {
+				addSymbol(codebook.prefixes[i], codebook.pref_len[i]);
+				addSymbol(len - codebook.data_min[i], codebook.data_len[i]);
+				//printf("0x%02x %d %d %d\n", prefixes[i], pref_len[i], len, data_len[i]);
+				break;
+			}
+		}
+
+		if (i >= codebook.INTERVALS)
+			m_failed = true;
+
+		return *this;
+	}
+
+	/*!
+	 * True if some run added since reset() was too long for the codebook,
+	 * the stream is incomplete then.
+	 */
+	bool failed() const {
+		return m_failed;
+	}
+
+	int size() {
+		return m_words * 4;
+	}
+
+	/*!
+	 * Number of runs added while encoding.
+	 */
+	int runs() {
+		return m_runs;
+	}
+
+	void finish() {
+		if (m_tmp_size > 0) {
+			addSymbol(0, 32-m_tmp_size);
+		}
+	}
+
+protected:
+	void addSymbol(int symb, int len) {
+		if (len < 1)
+			return;
+
+		//std::cout << "B: " << m_tmp << " " << m_tmp_size << std::endl;
+		m_tmp_size += len;
+		m_tmp <<= len;
+		m_tmp |= symb;
+		//std::cout << "A: " << m_tmp << " " << m_tmp_size << std::endl;
+		reduce();
+	}
+
+	/*!
+	 * Moves full word from the accumulator to the stream. Storage grows only
+	 * if the stream outgrows what was reserved.
+	 */
+	void reduce() {
+		if (m_tmp_size >= 32) {
+			m_tmp_size -= 32;
+			if (m_words == m_buffer.size())
+				m_buffer.resize(std::max<size_t>(2 * m_buffer.size(), 256));
+			m_buffer[m_words++] = (uint32_t)(m_tmp >> m_tmp_size);
+		}
+	}
+
+	/*!
+	 * Reads \a n (up to 32) bits into \a v, false if the stream ends before.
+	 */
+	bool getBits(int n, uint32_t & v) {
+		fillRead();
+		if (n > m_read_size)
+			return false;
+		v = n ? m_read_buf >> (64 - n) : 0;
+		m_read_buf <<= n;
+		m_read_size -= n;
+		return true;
+	}
+
+	/*!
+	 * Reads codes stored by setRunCodes(), false if they are malformed.
+	 */
+	bool readRunCodes() {
+		m_color = 0;
+		for (int k = 0; k < 2; ++k) {
+			RunCode & code = m_run_codes[k];
+			uint32_t n;
+			if (!getBits(7, n) || n > RUN_CLASSES)
+				return false;
+
+			// decoding table keeps its storage
+			std::fill(code.lengths, code.lengths + RUN_CLASSES, 0);
+			for (uint32_t c = 0; c < n; ++c) {
+				uint32_t len;
+				if (!getBits(4, len) || len > RunCode::MAX_LENGTH)
+					return false;
+				code.lengths[c] = len;
+			}
+
+			if (!code.assign())
+				return false;
+			code.buildTable();
+		}
+		return true;
+	}
+
+	/*!
+	 * Decodes run coded in PLANE_HUFFMAN mode: one table lookup for the class,
+	 * then its extra bits.
+	 */
+	int getNextClassLength() {
+		// codes are read with the first run, also when decoding what was just encoded
+		if (m_read_pos == 0 && !readRunCodes())
+			return 0;
+
+		fillRead();
+
+		uint16_t entry = m_run_codes[m_color].table[m_read_buf >> (64 - RunCode::MAX_LENGTH)];
+		int len = entry & 15;
+		if (len == 0 || len > m_read_size)
+			return 0;
+		m_read_buf <<= len;
+		m_read_size -= len;
+
+		int c = entry >> 4;
+		uint32_t extra;
+		if (!getBits(runExtraBits(c), extra))
+			return 0;
+
+		uint64_t run = runLength(c, extra);
+		if (run > 0x7FFFFFFF)
+			return 0;
+
+		m_color ^= 1;
+		return run;
+	}
+
+	void fillRead() {
+		uint64_t tmp;
+		if ( (m_read_size < 32) && (m_read_pos < m_words)) {
+			tmp = m_buffer[m_read_pos];
+			//std::cout << "From buffer: " << binary(tmp) << std::endl;
+
+			tmp <<= (32 - m_read_size);
+			m_read_buf |= tmp;
+
+			m_read_pos++;
+			m_read_size += 32;
+		}
+	}
+
+private:
+	// storage, the stream is its first m_words words
+	std::vector<uint32_t> m_buffer;
+	size_t m_words;
+	uint64_t m_tmp;
+	uint32_t m_tmp_size;
+	int m_runs;
+	bool m_failed;
+
+	size_t m_read_pos;
+	uint64_t m_read_buf;
+	uint64_t m_read_size;
+
+	RLEHeader m_header;
+
+	// codes of runs of the first and the other symbol, and which one is next
+	RunCode m_run_codes[2];
+	int m_color;
+
+	RleCodebook codebook;
+};
+
+/*!
+ * Histogram of run lengths, used to compute size of RLE stream for any codebook
+ * without encoding it.
+ */
+struct RunHistogram {
+	// every codebook codes runs this long or longer with its last interval
+	static const int LIMIT = 4096;
+	// fewer runs aren't worth fitting, it saves a few bytes at most on them
+	static const int FIT_MIN_RUNS = 256;
+
+	RunHistogram() : counts(LIMIT + 1, 0), longest(0), runs(0) {}
+
+	void clear() {
+		// counts past the longest run are still zero
+		std::fill(counts.begin(), counts.begin() + std::min(longest, (int)LIMIT) + 1, 0);
+		longest = 0;
+		runs = 0;
+	}
+
+	void add(int len) {
+		counts[len < LIMIT ? len : LIMIT]++;
+		if (len > longest)
+			longest = len;
+		runs++;
+	}
+
+	/*!
+	 * Size of RLE stream (in bytes, as RleBuffer::size()) for codebook \a cb,
+	 * -1 if the longest run is too long for it.
+	 */
+	int size(const RleCodebook & cb) const {
+		if (longest > cb.maxLength())
+			return -1;
+
+		int64_t total = 0;
+		for (int len = 1; len <= std::min(longest, (int)LIMIT); ++len)
+			if (counts[len])
+				total += (int64_t)counts[len] * cb.bits(len);
+		return ((total + 31) / 32) * 4;
+	}
+
+	/*!
+	 * ADAPTIVE codebook giving the smallest stream for these runs, its size is
+	 * returned in \a bytes.
+	 */
+	RleCodebook fit(int & bytes);
+
+	/*!
+	 * Fixed codebook giving the smallest stream, its size is returned in
+	 * \a bytes, -1 if no fixed codebook can code the longest run.
+	 */
+	RleCodebook fixed(int & bytes) const;
+
+	/*!
+	 * Fixed or fitted codebook giving the smallest stream, its size, including
+	 * interval lengths stored with the fitted one, is returned in \a bytes.
+	 * Codebook is fitted only to FIT_MIN_RUNS runs or more.
+	 */
+	RleCodebook best(int & bytes);
+
+	std::vector<int> counts;
+	int longest;
+	int runs;
+
+	// tables of fit(), kept for the next call
+	std::vector<int64_t> fit_below;
+	std::vector<int64_t> fit_cost;
+	std::vector<int64_t> fit_next;
+	std::vector<uint8_t> fit_step;
+};
+
+/*!
+ * Histogram of run length classes, separate for runs of the first symbol and
+ * the other one, used to build RunCode and to compute PLANE_HUFFMAN stream size.
+ */
+struct RunClassHistogram {
+	RunClassHistogram() {
+		clear();
+	}
+
+	void clear() {
+		std::fill(counts[0], counts[0] + RUN_CLASSES, 0);
+		std::fill(counts[1], counts[1] + RUN_CLASSES, 0);
+		color = 0;
+	}
+
+	void add(int len) {
+		int extra_len;
+		uint32_t extra;
+		counts[color][runClass(len, extra_len, extra)]++;
+		color ^= 1;
+	}
+
+	/*!
+	 * Size of stream coded with codes built for this histogram (in bytes, as
+	 * RleBuffer::size()), codes are returned in \a codes.
+	 */
+	int size(RunCode * codes) const;
+
+	uint32_t counts[2][RUN_CLASSES];
+	int color;
+};
+
+template <typename T, typename Sink>
+uchar scanRuns(const cv::Mat & img, int plane, Sink & sink, T) {
+	cv::Size size = img.size();
+	uint32_t ctr = 0;
+	uchar first_symbol = 0;
+	uchar current_symbol = 128;
+	T mask = 1 << plane;
+
+	for (int y = 0; y < size.height; ++y) {
+
+		const T* img_p = img.ptr <T> (y);
+
+		for (int x = 0; x < size.width; ++x) {
+			uchar symbol = (img_p[x] & mask) ? 255 : 0;
+
+			if (current_symbol == 128) {
+				current_symbol = symbol;
+				first_symbol = symbol;
+			}
+
+			if (symbol != current_symbol) {
+				sink.add(ctr);
+				ctr = 1;
+				current_symbol = 255-current_symbol;
+			} else {
+				ctr++;
+			}
+		}
+	}
+
+	if (ctr > 0)
+		sink.add(ctr);
+
+	return first_symbol;
+}
+
+/*!
+ * Counts of PLANE_READ codes: bits of mode codes and histogram of run lengths
+ * of horizontal mode, used to pick the codebook and compute stream size.
+ */
+struct ReadHistogram {
+	ReadHistogram() : mode_bits(0) {}
+
+	void clear() {
+		runs.clear();
+		mode_bits = 0;
+		codes.clear();
+	}
+
+	void addMode(int mode) {
+		mode_bits += READ_CODES[mode][1];
+		codes.push_back(-1 - mode);
+	}
+
+	void add(int len) {
+		runs.add(len);
+		codes.push_back(len);
+	}
+
+	/*!
+	 * Passes counted codes to \a sink in their order, as scanRead() did.
+	 */
+	template <typename Sink>
+	void replay(Sink & sink) const {
+		for (size_t i = 0; i < codes.size(); ++i)
+			if (codes[i] < 0)
+				sink.addMode(-1 - codes[i]);
+			else
+				sink.add(codes[i]);
+	}
+
+	/*!
+	 * Size of PLANE_READ stream (in bytes, as RleBuffer::size()) with fixed
+	 * codebook best for the runs, which is returned in \a cb, -1 if no fixed
+	 * codebook can code the longest run.
+	 */
+	int size(RleCodebook & cb) const {
+		int bytes;
+		cb = runs.fixed(bytes);
+		if (bytes < 0)
+			return -1;
+		return bytes + ((mode_bits + 31) / 32) * 4;
+	}
+
+	RunHistogram runs;
+	int64_t mode_bits;
+	// modes (as -1 - mode) and run lengths in stream order
+	std::vector<int> codes;
+};
+
+/*!
+ * Both run histograms of a plane, filled by one scan, and the runs themselves,
+ * so the plane is coded without scanning it again.
+ */
+struct PlaneRuns {
+	PlaneRuns() : count(0), first_symbol(0) {}
+
+	void add(int len) {
+		lengths.add(len);
+		classes.add(len);
+		// storage is kept by clear(), so it grows only for the first planes
+		if (count == list.size())
+			list.resize(std::max<size_t>(2 * list.size(), 256));
+		list[count++] = len;
+	}
+
+	void clear() {
+		lengths.clear();
+		classes.clear();
+		count = 0;
+	}
+
+	/*!
+	 * Passes counted runs to \a sink in their order.
+	 */
+	template <typename Sink>
+	void replay(Sink & sink) const {
+		for (size_t i = 0; i < count; ++i)
+			sink.add(list[i]);
+	}
+
+	RunHistogram lengths;
+	RunClassHistogram classes;
+	// run lengths, the first count of them are valid
+	std::vector<uint32_t> list;
+	size_t count;
+	uchar first_symbol;
+	// PLANE_HUFFMAN codes built by classes.size()
+	RunCode codes[2];
+};
+
+/*!
+ * Finds runs in bit plane \a plane of 8 or 16-bit \a img (set bit is symbol 255,
+ * cleared bit is 0) and passes their lengths to sink.add(). Runs continue across
+ * rows, as in the decoder. Returns the first symbol.
+ */
+template <typename Sink>
+uchar scanRuns(const cv::Mat & img, int plane, Sink & sink) {
+	if (img.depth() == CV_16U)
+		return scanRuns(img, plane, sink, uint16_t());
+	else
+		return scanRuns(img, plane, sink, uchar());
+}
+
+/*!
+ * As scanRuns() above, for packed \a plane. Bit changes are found a word at a
+ * time, so long runs cost no more than the words they cover.
+ */
+template <typename Sink>
+uchar scanRuns(const PackedPlane & plane, Sink & sink) {
+	if (plane.width == 0 || plane.height == 0)
+		return 0;
+
+	int words = plane.stride;
+	int tail = plane.width & 63;
+	uint64_t tail_mask = tail ? ~(uint64_t)0 >> (64 - tail) : ~(uint64_t)0;
+	// previous bit, the first one starts no run
+	uint64_t carry = plane.row(0)[0] & 1;
+	uchar first_symbol = carry ? 255 : 0;
+	int64_t start = 0;
+
+	for (int y = 0; y < plane.height; ++y) {
+		const uint64_t * row = plane.row(y);
+		int64_t base = (int64_t)y * plane.width;
+
+		for (int w = 0; w < words; ++w) {
+			uint64_t bits = row[w];
+			uint64_t diff = bits ^ (bits << 1 | carry);
+			carry = bits >> 63;
+			if (w == words - 1) {
+				// padding past the row width is undefined
+				diff &= tail_mask;
+				carry = (bits >> ((tail ? tail : 64) - 1)) & 1;
+			}
+
+			while (diff) {
+				int64_t x = base + w * 64 + __builtin_ctzll(diff);
+				sink.add(x - start);
+				start = x;
+				diff &= diff - 1;
+			}
+		}
+	}
+
+	sink.add((int64_t)plane.width * plane.height - start);
+	return first_symbol;
+}
+
+cv::Mat rle(RleBuffer & buf);
+int rle(RleBuffer & buf, PackedPlane & plane);
+
+/*!
+ * As rle(buf, plane), with row change lists of PLANE_READ streams kept in
+ * \a changes, so that decoding more planes of that width doesn't allocate.
+ */
+int rle(RleBuffer & buf, PackedPlane & plane, std::vector<int> & changes);
+RleBuffer rle(const cv::Mat & img, int plane, int type);
+RleBuffer rle(const cv::Mat & img, int type = 0);
+
+/*!
+ * Run-length encodes bit plane \a plane of \a img with codebook \a cb, e.g.
+ * fitted to its runs by RunHistogram::fit().
+ */
+RleBuffer rle(const cv::Mat & img, int plane, const RleCodebook & cb);
+void rle(const cv::Mat & img, int plane, const RleCodebook & cb, RleBuffer & result);
+
+/*!
+ * Run-length encodes bit plane \a plane of \a img in PLANE_HUFFMAN mode, with
+ * codes built for its runs.
+ */
+RleBuffer rleClasses(const cv::Mat & img, int plane);
+void rleClasses(const cv::Mat & img, int plane, RleBuffer & result);
+
+/*!
+ * Codes bit plane \a plane of \a img in PLANE_READ mode, every row against the
+ * one above (the first against cleared row), with codebook best for its runs.
+ */
+RleBuffer rleRead(const cv::Mat & img, int plane);
+
+// ===============================================================================================
+//
+// XOR
+//
+// ===============================================================================================
+
+cv::Mat en_xor(const cv::Mat & img);
+cv::Mat de_xor(const cv::Mat & img);
+
+void de_xor(PackedPlane & plane);
+void de_xor_up(PackedPlane & plane);
+void de_xor_majority(PackedPlane & plane);
+void unpredict(PackedPlane & plane, int predictor);
+
+// ===============================================================================================
+//
+// Bayer split/merge
+//
+// ===============================================================================================
+
+std::vector<cv::Mat> bayerSplit(const cv::Mat & img);
+cv::Mat bayerMerge(std::vector<cv::Mat> & channels);
+
+/*!
+ * As above, into \a channels or \a img, whose storage is reused if it fits.
+ */
+void bayerSplit(const cv::Mat & img, std::vector<cv::Mat> & channels);
+void bayerMerge(const std::vector<cv::Mat> & channels, cv::Mat & img);
+
+/*!
+ * Color filter array layout of raw mosaic, colors of the top-left 2x2 block
+ * (first row, then second row starts with the other green).
+ */
+enum CfaPattern {
+	CFA_BG = 0,
+	CFA_GB = 1,
+	CFA_RG = 2,
+	CFA_GR = 3
+};
+
+/*!
+ * Splits single channel raw sensor mosaic (8 or 16-bit) into 4 sub-planes, one
+ * per position in 2x2 block: (0,0), (0,1), (1,0), (1,1). Sub-planes of odd
+ * sized mosaic differ in size (and may be empty for one pixel wide mosaic).
+ */
+std::vector<cv::Mat> mosaicSplit(const cv::Mat & img);
+
+/*!
+ * Exact inverse of mosaicSplit().
+ */
+cv::Mat mosaicMerge(const std::vector<cv::Mat> & channels);
+
+/*!
+ * As above, into \a channels or \a img, whose storage is reused if it fits.
+ */
+void mosaicSplit(const cv::Mat & img, std::vector<cv::Mat> & channels);
+void mosaicMerge(const std::vector<cv::Mat> & channels, cv::Mat & img);
+
+// ===============================================================================================
+//
+// Reversible color transform
+//
+// ===============================================================================================
+
+/*!
+ * Lossless YCoCg-R transform of BGR image with \a depth bits per component
+ * (up to 12): Co = R - B, t = B + (Co >> 1), Cg = G - t, Y = t + (Cg >> 1).
+ * Y has the depth of the image, chroma one bit more and is stored offset by
+ * 2^depth in 16-bit channels. Around zero the offset flips every plane, so
+ * chroma codes best with Gray coding, where plane \a depth is the sign and
+ * lower planes the magnitude.
+ */
+std::vector<cv::Mat> ycocgSplit(const cv::Mat & img, int depth);
+
+/*!
+ * Exact inverse of ycocgSplit().
+ */
+cv::Mat ycocgMerge(const std::vector<cv::Mat> & channels, int depth);
+
+/*!
+ * As above, into \a channels or \a img, whose storage is reused if it fits.
+ * \a bgr holds the image split into planes on the way.
+ */
+void ycocgSplit(const cv::Mat & img, int depth, std::vector<cv::Mat> & channels, std::vector<cv::Mat> & bgr);
+void ycocgMerge(const std::vector<cv::Mat> & channels, int depth, cv::Mat & img, std::vector<cv::Mat> & bgr);
+
+// ===============================================================================================
+//
+// Huffman encoding
+//
+// ===============================================================================================
+
+/*!
+ * Huffman codes file \a in_f into \a out_f, returns number of codes in table.
+ */
+int enchuf(const std::string & in_f, const std::string & out_f);
+
+/*!
+ * Huffman codes rest of stream \a in into \a out, as above.
+ */
+int enchuf(std::istream & in, std::ostream & out);
+
+/*!
+ * Decodes file \a in_f coded by enchuf() into \a out_f, returns number of codes in table
+ * (-1 if \a in_f is malformed).
+ */
+int dechuf(const std::string & in_f, const std::string & out_f);
+
+/*!
+ * Decodes stream \a in coded by enchuf() into \a out, as above.
+ */
+int dechuf(std::istream & in, std::ostream & out);
+
+// ===============================================================================================
+//
+// Encode and decode routines
+//
+// ===============================================================================================
+
+// most channels a conversion produces
+static const int MAX_CHANNELS = 4;
+
+struct Header {
+	Header() : gray(false), exor(false), crc(true), channels(0), depth(8), conversion(1), cfa(CFA_BG), post(0), psnr(0) {
+		for (int i = 0; i < MAX_CHANNELS; ++i)
+			planes[i] = MAX_DEPTH;
+	}
+
+	bool gray;
+	bool exor;
+	// CRC32C of every plane record, checked when decoding
+	bool crc;
+	int channels;
+	// bit planes per channel: 8 for 8-bit images, 10, 12 or 16 for 16-bit ones
+	// (as many as the largest value needs)
+	int depth;
+	// 1 - RGB, 2 - HSV, 3 - Bayer, 4 - raw mosaic, 5 - YCoCg-R (0 - automatic, encoder only)
+	int conversion;
+	// CfaPattern of raw mosaic, only stored for the reader (sub-planes are
+	// coded alike whatever their color)
+	int cfa;
+	// 0 - none, 1 - huffman (for planes it makes smaller)
+	int post;
+	// number of most significant planes stored per channel (depth or more - lossless),
+	// dropped planes are filled with midpoint of their range when decoding
+	int planes[MAX_CHANNELS];
+	// target PSNR in dB, planes are dropped while it is met (0 - keep planes, encoder only)
+	float psnr;
+};
+
+/*!
+ * Wall time spent in each stage of encode()/decode(), in seconds. Times are
+ * added to the values already present, so one StageTimes can sum many runs.
+ */
+struct StageTimes {
+	StageTimes() : read(0), split(0), gray(0), exor(0), rle(0), huffman(0), write(0), search(0) {}
+
+	// loading image or coded file
+	double read;
+	// colorspace conversion and channel split (merge when decoding)
+	double split;
+	// Gray coding (merging planes and Gray decoding)
+	double gray;
+	// plane prediction and its inverse
+	double exor;
+	// codebook selection and run-length coding
+	double rle;
+	// Huffman post-processing
+	double huffman;
+	// storing coded file or image
+	double write;
+	// automatic configuration search
+	double search;
+};
+
+/*!
+ * Coding details of one plane record.
+ */
+struct PlaneStats {
+	PlaneStats() : channel(0), plane(0), mode(PLANE_RLE), predictor(PRED_NONE), type(0), runs(0), rle_bytes(0), coded_bytes(0), huffman_codes(0) {}
+
+	int channel;
+	int plane;
+	// PlaneMode
+	int mode;
+	int predictor;
+	// RLE codebook type, RleCodebook::ADAPTIVE if fitted to the plane
+	int type;
+	int runs;
+	// RLE stream (or raw bits) size
+	int rle_bytes;
+	// stored record size (after Huffman, if used)
+	int coded_bytes;
+	// Huffman table size, 0 if record wasn't Huffman coded
+	int huffman_codes;
+};
+
+/*!
+ * Instrumentation of encode()/decode(). Collection is opt-in: without stats
+ * object passed the codec only does a NULL check per stage and plane.
+ *
+ * Bytes in/out are raw pixel bytes and coded file bytes, in order of
+ * processing (so swapped between encoding and decoding).
+ */
+struct CodecStats {
+	CodecStats() : bytes_in(0), bytes_out(0), runs(0) {}
+
+	StageTimes times;
+	int64_t bytes_in;
+	int64_t bytes_out;
+	int64_t runs;
+	std::vector<PlaneStats> planes;
+
+	/*!
+	 * Writes all values as JSON object.
+	 */
+	void writeJson(std::ostream & out) const;
+};
+
+// ===============================================================================================
+//
+// Coded file format
+//
+// ===============================================================================================
+
+/*!
+ * Coded file starts with magic "RLEC" and format version (1 byte), followed
+ * by Header fields, 1 byte each: flags (1 - gray, 2 - exor, 4 - crc),
+ * channels, depth, conversion, cfa, post and planes of every of MAX_CHANNELS
+ * channels.
+ *
+ * Records follow, one per stored plane, channel by channel from the lowest
+ * stored plane. Every record starts with channel (1 byte), plane (1), flags
+ * (1), data length (4) and CRC32C of these and the data (4, 0 if crc flag
+ * isn't set), so it can be checked or skipped without decoding. All numbers
+ * are little-endian. Data is RleBuffer saved with saveToFile(), or its
+ * Huffman coded form if RECORD_HUFFMAN is set.
+ *
+ * RleBuffer starts with first symbol (1), width (2), height (2), codebook
+ * type (1), predictor (1) and PlaneMode (1). Type RleCodebook::ADAPTIVE is
+ * followed by its 7 interval lengths (1 byte each, at most 25).
+ * Word count (4) and the words of the stream come last. PLANE_HUFFMAN
+ * streams begin with code lengths of both run class tables, PLANE_READ
+ * streams are ReadMode codes with run lengths of horizontal mode.
+ *
+ * Version 2 added PLANE_HUFFMAN, 3 ADAPTIVE codebooks, 4 PLANE_READ.
+ */
+static const int FORMAT_VERSION = 4;
+
+enum RecordFlags {
+	RECORD_HUFFMAN = 1
+};
+
+struct PlaneRecord {
+	PlaneRecord() : channel(0), plane(0), flags(0) {}
+
+	uint8_t channel;
+	uint8_t plane;
+	uint8_t flags;
+	std::string data;
+};
+
+/*!
+ * CRC32C (Castagnoli) of \a n bytes, continuing \a crc of preceding data.
+ */
+uint32_t crc32c(const void * data, size_t n, uint32_t crc = 0);
+
+void writeHeader(std::ostream & f, const Header & header);
+
+/*!
+ * Reads header, false if the stream isn't coded file of known version.
+ */
+bool readHeader(std::istream & f, Header & header);
+
+/*!
+ * Writes record, with its checksum if \a crc is set.
+ */
+void writeRecord(std::ostream & f, const PlaneRecord & record, bool crc = true);
+
+/*!
+ * Reads next record, false if it is truncated or (if \a check is set) its
+ * checksum doesn't match.
+ */
+bool readRecord(std::istream & f, PlaneRecord & record, bool check = true);
+
+/*!
+ * Number of bit planes needed for \a img: 8 for 8-bit images, 10, 12 or 16 for
+ * 16-bit ones, depending on their largest value. 0 if the depth is unsupported.
+ */
+int imageDepth(const cv::Mat & img);
+
+struct CodecContext;
+
+/*!
+ * Chooses conversion, Gray coding and prediction for \a img by estimating
+ * coded size of every lossless configuration from run histograms of a
+ * subsample of rows. Other fields are copied from \a header, its depth must
+ * be already set for \a img. Buffers are taken from \a context if given.
+ */
+Header autoHeader(const cv::Mat & img, Header header, CodecContext * context = NULL);
+
+/*!
+ * Lowers \a header.planes as long as PSNR of \a channels reconstructed with
+ * midpoint fill stays at or above \a header.psnr. Every step drops the plane
+ * adding the least squared error, so channels with less detail lose more planes.
+ * For YCoCg (conversion 5) and HSV (conversion 2) PSNR is measured on RGB
+ * values decoded back from the planes, not on the channels themselves. HSV is
+ * lossy by itself, its loss is measured against the image decoded from all
+ * planes.
+ */
+Header lossyPlanes(const std::vector<cv::Mat> & channels, Header header);
+
+/*!
+ * Buffers of encode() and decode() kept between images: channels, residuals,
+ * packed planes, plane streams and records. They grow to the largest image
+ * coded with the context, further images of that size reuse them instead of
+ * allocating. Context must not be shared by concurrent calls, every thread
+ * needs its own.
+ */
+struct CodecContext {
+	// channels split from coded image, or decoded ones
+	std::vector<cv::Mat> channels;
+	// candidate residuals of every coded channel, indexed by channel and
+	// Predictor, so channels of different depth don't share buffers
+	std::vector<std::vector<cv::Mat> > residuals;
+	// packed planes of every decoded channel
+	std::vector<std::vector<PackedPlane> > planes;
+	// unpredicted plane, coded raw or in PLANE_READ mode
+	PackedPlane packed;
+	// predicted plane while its runs are counted
+	PackedPlane predicted;
+	// runs of every candidate residual plane, indexed by Predictor
+	std::vector<PlaneRuns> runs;
+	ReadHistogram read;
+	// row change lists of PLANE_READ coding
+	std::vector<int> changes;
+	RleBuffer buf;
+	PlaneRecord record;
+	// record payload Huffman coded, or decoded from Huffman codes
+	std::string coded;
+	// merged decoded image
+	cv::Mat image;
+	// image converted to HSV or Bayer mosaic, or back from them
+	cv::Mat converted;
+	// colour planes split from or merged into image by YCoCg-R conversion
+	std::vector<cv::Mat> bgr;
+	// rows of coded image sampled by autoHeader(), their channels for every
+	// tried conversion and residuals of these (conversion * MAX_CHANNELS +
+	// channel)
+	cv::Mat sample;
+	std::vector<std::vector<cv::Mat> > sample_channels;
+	std::vector<std::vector<cv::Mat> > sample_residuals;
+};
+
+/*!
+ * Encodes image file, header.conversion 0 lets autoHeader() pick the configuration.
+ * Buffers are taken from \a context if given, otherwise allocated for this call.
+ */
+bool encode(const std::string & in_fname, const std::string & out_fname, Header header, CodecStats * stats = NULL, CodecContext * context = NULL);
+bool decode(const std::string & in_fname, const std::string & out_fname, CodecStats * stats = NULL, CodecContext * context = NULL);
+
+#endif // _CODEC_H_INCLUDED_
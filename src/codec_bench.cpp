@@ -0,0 +1,180 @@
+/*!
+ * \file
+ * \brief Benchmark of codec stages over all configurations
+ *
+ * Encodes and decodes every image with every combination of conversion, Gray
+ * coding, prediction and Huffman post-processing, and prints one CSV line per
+ * image and configuration with per-stage times, throughput and compression.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdio>
+
+#include <sys/resource.h>
+
+#include <cv.h>
+#include <highgui.h>
+
+#include <boost/program_options.hpp>
+
+#include "codec.h"
+
+#ifndef RLE_DATA_DIR
+#define RLE_DATA_DIR "."
+#endif
+
+namespace po = boost::program_options;
+
+static const char * conversions[] = { "", "RGB", "HSV", "Bayer", "Raw", "YCoCg" };
+
+/*!
+ * Peak resident set size of the process so far, in kilobytes.
+ */
+static long peakRss() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+static double total(const StageTimes & t) {
+	return t.read + t.split + t.gray + t.exor + t.rle + t.huffman + t.write + t.search;
+}
+
+static long fileSize(const std::string & fname) {
+	std::ifstream f(fname.c_str(), std::ios_base::in | std::ios_base::binary);
+	f.seekg(0, std::ios::end);
+	return f ? (long)f.tellg() : 0;
+}
+
+static void printStages(std::ostream & out, const StageTimes & t) {
+	out << "," << t.read << "," << t.split << "," << t.gray << "," << t.exor
+			<< "," << t.rle << "," << t.huffman << "," << t.write;
+}
+
+static void printStagesHeader(std::ostream & out, const std::string & prefix) {
+	const char * names[] = { "read", "split", "gray", "xor", "rle", "huffman", "write" };
+	for (int i = 0; i < 7; ++i)
+		out << "," << prefix << names[i];
+}
+
+int main(int argc, char * argv[]) {
+	int repeat;
+	std::string output_fname;
+	std::string tmp_fname;
+	std::vector<std::string> inputs;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("repeat,r", po::value<int>(&repeat)->default_value(3), "runs per configuration, fastest one is reported")
+		("output,O", po::value<std::string>(&output_fname), "CSV output file (standard output by default)")
+		("tmp,T", po::value<std::string>(&tmp_fname)->default_value("codec_bench.tmp"), "prefix of scratch files")
+		("input,I", po::value<std::vector<std::string> >(&inputs), "images to test (bundled ones by default)")
+	;
+
+	po::positional_options_description pos;
+	pos.add("input", -1);
+
+	po::variables_map vm;
+
+	try {
+		po::store(po::command_line_parser(argc, argv).options(desc).positional(pos).run(), vm);
+		po::notify(vm);
+	}
+	catch (const po::error & u) {
+		std::cout << u.what() << "\n";
+		return 1;
+	}
+
+	if (vm.count("help")) {
+		std::cout << desc << "\n";
+		return 0;
+	}
+
+	if (inputs.empty()) {
+		inputs.push_back(RLE_DATA_DIR "/lena.bmp");
+		inputs.push_back(RLE_DATA_DIR "/peppers.bmp");
+		inputs.push_back(RLE_DATA_DIR "/f16.bmp");
+	}
+
+	if (repeat < 1)
+		repeat = 1;
+
+	std::ofstream file;
+	if (!output_fname.empty())
+		file.open(output_fname.c_str());
+	std::ostream & out = output_fname.empty() ? std::cout : file;
+
+	std::string coded_fname = tmp_fname + ".rle";
+	std::string decoded_fname = tmp_fname + ".bmp";
+
+	out << "image,width,height,channels,conversion,gray,xor,huffman,raw_bytes,coded_bytes,ratio"
+		<< ",enc_s,enc_mbps,dec_s,dec_mbps";
+	printStagesHeader(out, "enc_");
+	printStagesHeader(out, "dec_");
+	out << ",peak_rss_kb\n";
+
+	for (int i = 0; i < inputs.size(); ++i) {
+		cv::Mat img = cv::imread(inputs[i].c_str(), CV_LOAD_IMAGE_ANYDEPTH | CV_LOAD_IMAGE_COLOR);
+		if (img.empty()) {
+			std::cerr << "Can't load image from file: " << inputs[i] << std::endl;
+			continue;
+		}
+
+		double raw_bytes = (double)img.size().width * img.size().height * img.elemSize();
+
+		for (int conversion = 1; conversion <= 5; ++conversion)
+		for (int gray = 0; gray < 2; ++gray)
+		for (int exor = 0; exor < 2; ++exor)
+		for (int post = 0; post < 2; ++post) {
+			// raw mosaic needs single channel input
+			if (conversion == 4)
+				continue;
+
+			Header header;
+			header.gray = gray;
+			header.exor = exor;
+			header.conversion = conversion;
+			header.post = post;
+
+			StageTimes enc;
+			StageTimes dec;
+			// repeats after the first one code with warm buffers
+			CodecContext context;
+
+			for (int r = 0; r < repeat; ++r) {
+				CodecStats stats;
+				encode(inputs[i], coded_fname, header, &stats, &context);
+				if (r == 0 || total(stats.times) < total(enc))
+					enc = stats.times;
+			}
+
+			for (int r = 0; r < repeat; ++r) {
+				CodecStats stats;
+				decode(coded_fname, decoded_fname, &stats, &context);
+				if (r == 0 || total(stats.times) < total(dec))
+					dec = stats.times;
+			}
+
+			long coded_bytes = fileSize(coded_fname);
+
+			out << inputs[i] << "," << img.size().width << "," << img.size().height << "," << img.channels()
+				<< "," << conversions[conversion] << "," << gray << "," << exor << "," << post
+				<< "," << (long)raw_bytes << "," << coded_bytes << "," << coded_bytes / raw_bytes
+				<< "," << total(enc) << "," << raw_bytes / 1048576.0 / total(enc)
+				<< "," << total(dec) << "," << raw_bytes / 1048576.0 / total(dec);
+			printStages(out, enc);
+			printStages(out, dec);
+			out << "," << peakRss() << "\n";
+			out.flush();
+		}
+	}
+
+	std::remove(coded_fname.c_str());
+	std::remove(decoded_fname.c_str());
+
+	return 0;
+}
@@ -0,0 +1,338 @@
+/*!
+ * \file
+ * \brief Command line front-end of the codec
+ */
+
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <string>
+#include <sstream>
+#include <cstdlib>
+#include <algorithm>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <glob.h>
+
+#include <boost/program_options.hpp>
+
+#include "codec.h"
+
+// ===============================================================================================
+//
+// Batch mode
+//
+// ===============================================================================================
+
+/*!
+ * Collects batch inputs: files matching \a source if it is a glob pattern
+ * (e.g. "images/\*.bmp"), otherwise paths listed in file \a source, one per line.
+ */
+std::vector<std::string> batchInputs(const std::string & source) {
+	std::vector<std::string> result;
+
+	if (source.find_first_of("*?[") != std::string::npos) {
+		glob_t g;
+		if (glob(source.c_str(), 0, NULL, &g) == 0) {
+			for (size_t i = 0; i < g.gl_pathc; ++i)
+				result.push_back(g.gl_pathv[i]);
+		}
+		globfree(&g);
+		return result;
+	}
+
+	std::ifstream f(source.c_str());
+	if (!f) {
+		std::cout << "Can't open batch list: " << source << std::endl;
+		return result;
+	}
+
+	std::string line;
+	while (std::getline(f, line)) {
+		if (!line.empty() && line[line.size()-1] == '\r')
+			line.erase(line.size()-1);
+		if (!line.empty())
+			result.push_back(line);
+	}
+
+	return result;
+}
+
+static int64_t fileSize(const std::string & fname) {
+	std::ifstream f(fname.c_str(), std::ios_base::in | std::ios_base::binary);
+	f.seekg(0, std::ios::end);
+	return f ? (int64_t)f.tellg() : 0;
+}
+
+/*!
+ * Output names of batch \a inputs, next to them or in \a out_dir if given.
+ * False if two inputs would be written to the same file, which happens when
+ * files of the same name from different directories go to \a out_dir.
+ */
+static bool batchOutputs(const std::vector<std::string> & inputs, const std::string & out_dir, bool dec, std::vector<std::string> & outputs) {
+	std::map<std::string, size_t> taken;
+	outputs.resize(inputs.size());
+
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		const std::string & in_fname = inputs[i];
+		std::string & out_fname = outputs[i];
+		out_fname = in_fname;
+		if (!out_dir.empty())
+			out_fname = out_dir + "/" + in_fname.substr(in_fname.find_last_of('/') + 1);
+		out_fname += dec ? ".bmp" : ".rle";
+
+		std::map<std::string, size_t>::const_iterator it = taken.find(out_fname);
+		if (it != taken.end()) {
+			std::cout << "Both " << inputs[it->second] << " and " << in_fname << " would be written to " << out_fname << std::endl;
+			return false;
+		}
+		taken[out_fname] = i;
+	}
+
+	return true;
+}
+
+/*!
+ * Encodes (or decodes) all \a inputs on a pool of \a threads workers. Every
+ * worker takes next file, reads, codes and writes it, so there are never more
+ * than \a threads images in flight. Outputs go next to the inputs, or to
+ * \a out_dir if given. Returns number of failed files, all of them if outputs
+ * of two files collide and nothing is coded.
+ */
+int batch(const std::vector<std::string> & inputs, const std::string & out_dir, const Header & header, bool dec, int threads) {
+	std::vector<std::string> outputs;
+	if (!batchOutputs(inputs, out_dir, dec, outputs))
+		return inputs.size();
+
+	std::atomic<size_t> next(0);
+	std::atomic<int> failed(0);
+	std::atomic<int64_t> bytes_in(0);
+	std::atomic<int64_t> bytes_out(0);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; ++t) {
+		workers.push_back(std::thread([&]() {
+			// buffers are reused from one file to the next
+			CodecContext context;
+			for (;;) {
+				size_t i = next++;
+				if (i >= inputs.size())
+					break;
+
+				const std::string & in_fname = inputs[i];
+				const std::string & out_fname = outputs[i];
+
+				bool ok = dec ? decode(in_fname, out_fname, NULL, &context) : encode(in_fname, out_fname, header, NULL, &context);
+				if (!ok) {
+					failed++;
+					continue;
+				}
+
+				bytes_in += fileSize(in_fname);
+				bytes_out += fileSize(out_fname);
+			}
+		}));
+	}
+
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double mb_in = bytes_in / 1048576.0;
+	double mb_out = bytes_out / 1048576.0;
+
+	std::cout << "Processed " << inputs.size() - failed << " of " << inputs.size() << " files on "
+			<< threads << " threads in " << secs << " s\n";
+	std::cout << "  " << (inputs.size() - failed) / secs << " files/s, "
+			<< mb_in / secs << " MB/s in, " << mb_out / secs << " MB/s out";
+	if (bytes_in > 0)
+		std::cout << ", size " << 100.0 * bytes_out / bytes_in << "%";
+	std::cout << "\n";
+
+	return failed;
+}
+
+// ===============================================================================================
+//
+// Entry point
+//
+// ===============================================================================================
+
+
+namespace po = boost::program_options;
+
+int main(int argc, char * argv[]) {
+	// Declare the supported options.
+
+	std::string conversion;
+	std::string cfa;
+	std::string input_fname;
+	std::string output_fname;
+	std::string batch_source;
+	std::string stats_fname;
+	std::string planes;
+	float psnr;
+	int threads;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("conversion,C", po::value<std::string>(&conversion)->default_value("RGB"), "colorspace conversion\n"
+				"possible values are: RGB, HSV, Bayer, Raw (single channel sensor mosaic, coded exactly), "
+				"YCoCg (lossless YCoCg-R, best with -G)")
+		("cfa", po::value<std::string>(&cfa)->default_value("BG"), "color filter array of Raw mosaic: BG, GB, RG or GR")
+		("gray,G", "convert channels to Gray encoding")
+		("xor,X", "predict bit planes (left, up or 2D, best one per plane)")
+		("huffman,H", "Huffman encoding")
+		("no-crc", "don't store CRC32C of plane records (they aren't checked when decoding then)")
+		("auto,A", "choose conversion, Gray coding and xor per image (lossless conversions only)")
+		("planes,P", po::value<std::string>(&planes), "lossy: store only K most significant planes per channel, "
+				"one K for all channels or comma separated list, e.g. 8,6,6")
+		("psnr", po::value<float>(&psnr)->default_value(0), "lossy: drop planes while PSNR (dB) stays above given target")
+		("decode,D", "decode given file")
+		("input,I",po::value<std::string>(&input_fname), "input file")
+		("output,O",po::value<std::string>(&output_fname), "output file (output directory in batch mode)")
+		("batch,B",po::value<std::string>(&batch_source), "code all files matching given glob pattern, "
+				"or listed in given file")
+		("threads,j",po::value<int>(&threads)->default_value(0), "worker threads in batch mode (0 - one per core)")
+		("stats,S",po::value<std::string>(&stats_fname), "write timing and per plane statistics as JSON "
+				"to given file (- for standard output)")
+	;
+
+	po::variables_map vm;
+
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	}
+	catch (const po::error & u) {
+		std::cout << u.what() << "\n";
+		return 0;
+	}
+
+	if (vm.count("help") || argc < 2) {
+		std::cout << desc << "\n";
+		return 0;
+	}
+
+	if (input_fname == "" && batch_source == "") {
+		std::cout << "No input file specified.\n";
+		return 0;
+	}
+
+	if (output_fname == "") {
+		output_fname = input_fname + ".rle";
+	}
+
+	Header header;
+	if (vm.count("gray")) {
+		header.gray = 1;
+	} else {
+		header.gray = 0;
+	}
+
+	if (vm.count("xor")) {
+		header.exor = 1;
+	} else {
+		header.exor = 0;
+	}
+
+	if (vm.count("huffman")) {
+		header.post = 1;
+	} else {
+		header.post = 0;
+	}
+
+	header.crc = vm.count("no-crc") == 0;
+
+	if (conversion == "RGB") {
+		header.conversion = 1;
+	} else
+	if (conversion == "HSV") {
+		header.conversion = 2;
+	} else
+	if (conversion == "Bayer") {
+		header.conversion = 3;
+	} else
+	if (conversion == "Raw") {
+		header.conversion = 4;
+	} else
+	if (conversion == "YCoCg") {
+		header.conversion = 5;
+	} else {
+		std::cout << "Unknown conversion: " << conversion << "\n";
+		return 0;
+	}
+
+	const char * patterns[] = { "BG", "GB", "RG", "GR" };
+	header.cfa = -1;
+	for (int i = 0; i < 4; ++i)
+		if (cfa == patterns[i])
+			header.cfa = i;
+	if (header.cfa < 0) {
+		std::cout << "Unknown color filter array: " << cfa << "\n";
+		return 0;
+	}
+
+	if (vm.count("auto")) {
+		header.conversion = 0;
+	}
+
+	if (planes != "") {
+		std::stringstream ss(planes);
+		std::string k;
+		int i = 0;
+		while (std::getline(ss, k, ',') && i < MAX_CHANNELS) {
+			header.planes[i] = atoi(k.c_str());
+			if (header.planes[i] < 1 || header.planes[i] > MAX_DEPTH) {
+				std::cout << "Number of planes must be between 1 and " << MAX_DEPTH << ": " << k << "\n";
+				return 0;
+			}
+			++i;
+		}
+		// last value applies to remaining channels
+		for (; i > 0 && i < MAX_CHANNELS; ++i)
+			header.planes[i] = header.planes[i-1];
+	}
+
+	header.psnr = psnr;
+
+
+	if (batch_source != "") {
+		std::vector<std::string> inputs = batchInputs(batch_source);
+		if (inputs.empty()) {
+			std::cout << "No files to code in batch: " << batch_source << "\n";
+			return 1;
+		}
+		if (threads <= 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		return batch(inputs, vm.count("output") ? output_fname : "", header, vm.count("decode") > 0, threads) ? 1 : 0;
+	}
+
+	CodecStats stats;
+	CodecStats * stats_p = stats_fname != "" ? &stats : NULL;
+
+	bool ok;
+	if (vm.count("decode")) {
+		ok = decode(input_fname, output_fname, stats_p);
+	} else {
+		ok = encode(input_fname, output_fname, header, stats_p);
+	}
+
+	if (!ok)
+		return 1;
+
+	if (stats_fname == "-") {
+		stats.writeJson(std::cout);
+	} else if (stats_fname != "") {
+		std::ofstream f(stats_fname.c_str());
+		stats.writeJson(f);
+	}
+
+	return 0;
+}
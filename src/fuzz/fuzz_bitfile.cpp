@@ -0,0 +1,35 @@
+/*!
+ * \file
+ * \brief Fuzz target for BitFileIn
+ *
+ * Reads input the way dechuf() reads table header, then as plain bits until
+ * it ends.
+ */
+
+#include <sstream>
+
+#include "huffman.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+	std::istringstream in(std::string((const char*)data, size));
+	BitFileIn inf(in);
+
+	if (inf.length() != (int)size)
+		abort();
+
+	try {
+		int big = inf.read_bits(8);
+		if (big & 4)
+			inf.read_bits(8);
+		inf.read_bits(big & 2 ? 16 : 8);
+		inf.read_bits(32);
+		inf.read_var_bits();
+
+		for (;;)
+			inf.GetBit();
+	} catch (int) {
+		// end of input
+	}
+
+	return 0;
+}
@@ -0,0 +1,19 @@
+/*!
+ * \file
+ * \brief Fuzz target for dechuf()
+ *
+ * Input is a file coded by enchuf(), decoded in memory.
+ */
+
+#include <sstream>
+
+#include "codec.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+	std::istringstream in(std::string((const char*)data, size));
+	std::ostringstream out;
+
+	dechuf(in, out);
+
+	return 0;
+}
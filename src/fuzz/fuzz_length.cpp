@@ -0,0 +1,25 @@
+/*!
+ * \file
+ * \brief Fuzz target for RleBuffer::getNextLength()
+ *
+ * Input is a plane record as written by RleBuffer::saveToFile(), all run
+ * lengths of its stream are decoded.
+ */
+
+#include <sstream>
+
+#include "codec.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+	std::istringstream in(std::string((const char*)data, size));
+
+	RleBuffer buf;
+	if (!buf.loadFromFile(in))
+		return 0;
+
+	// every run takes at least one bit, so this ends with the stream
+	while (buf.getNextLength() > 0)
+		;
+
+	return 0;
+}
@@ -0,0 +1,37 @@
+/*!
+ * \file
+ * \brief Fuzz target for rle(RleBuffer&) decoders
+ *
+ * Input is a plane record as written by RleBuffer::saveToFile(), it is decoded
+ * both into packed plane and into plane image.
+ */
+
+#include <sstream>
+
+#include "codec.h"
+
+// plane size comes from the input, keep images of 16 MB at most
+static const int64_t MAX_PIXELS = 1 << 24;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+	std::string record((const char*)data, size);
+
+	RleBuffer buf;
+	std::istringstream in(record);
+	if (!buf.loadFromFile(in) || (int64_t)buf.getWidth() * buf.getHeight() > MAX_PIXELS)
+		return 0;
+
+	PackedPlane plane;
+	if (buf.getMode() == PLANE_RAW)
+		buf.getRaw(plane);
+	else
+		rle(buf, plane);
+
+	// stream position is kept in buffer, start over for the second decoder
+	RleBuffer again;
+	std::istringstream in_again(record);
+	again.loadFromFile(in_again);
+	rle(again);
+
+	return 0;
+}
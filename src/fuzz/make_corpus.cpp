@@ -0,0 +1,103 @@
+/*!
+ * \file
+ * \brief Builds fuzz seed corpus from bundled images
+ *
+ * Encodes every image given on command line with Gray coding and prediction
+ * and stores a few records of the first channel as seeds: as they are in
+ * <out>/rle and coded by enchuf() in <out>/huffman. Planes of the gray image
+ * coded with fixed and fitted codebooks and with READ codes are added to
+ * <out>/rle too.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+
+#include <sys/stat.h>
+
+#include <cv.h>
+#include <highgui.h>
+
+#include "codec.h"
+
+// records of lower planes are mostly raw and large, a few are enough
+static const int PLANES[] = { 7, 6, 4 };
+
+static bool addSeeds(const std::string & img_fname, const std::string & out_dir) {
+	Header header;
+	header.gray = 1;
+	header.exor = 1;
+
+	std::string coded_fname = out_dir + "/tmp.rle";
+	if (!encode(img_fname, coded_fname, header))
+		return false;
+
+	std::ifstream f(coded_fname.c_str(), std::ios_base::in | std::ios_base::binary);
+	if (!readHeader(f, header))
+		return false;
+
+	std::string name = img_fname.substr(img_fname.find_last_of('/') + 1);
+	name = name.substr(0, name.find('.'));
+
+	PlaneRecord record;
+	while (readRecord(f, record) && record.channel == 0) {
+		if (std::find(PLANES, PLANES + 3, record.plane) == PLANES + 3)
+			continue;
+
+		std::ostringstream seed;
+		seed << name << "_" << (int)record.plane;
+
+		std::string rle_fname = out_dir + "/rle/" + seed.str();
+		std::ofstream out(rle_fname.c_str(), std::ios_base::out | std::ios_base::binary);
+		out.write(record.data.data(), record.data.size());
+		out.close();
+
+		enchuf(rle_fname, out_dir + "/huffman/" + seed.str());
+	}
+
+	f.close();
+	std::remove(coded_fname.c_str());
+
+	// the encoder prefers Huffman coded run classes, other modes need seeds of their own
+	cv::Mat img = cv::imread(img_fname.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
+	for (int k = 0; k < 3; ++k) {
+		std::ostringstream seed;
+		seed << out_dir << "/rle/" << name << "_" << PLANES[k];
+		std::ofstream out((seed.str() + "_fixed").c_str(), std::ios_base::out | std::ios_base::binary);
+		rle(img, PLANES[k], 2 * k).saveToFile(out);
+
+		RunHistogram hist;
+		scanRuns(img, PLANES[k], hist);
+		int sz;
+		std::ofstream fitted((seed.str() + "_fitted").c_str(), std::ios_base::out | std::ios_base::binary);
+		rle(img, PLANES[k], hist.fit(sz)).saveToFile(fitted);
+
+		std::ofstream read((seed.str() + "_read").c_str(), std::ios_base::out | std::ios_base::binary);
+		rleRead(img, PLANES[k]).saveToFile(read);
+	}
+
+	return true;
+}
+
+int main(int argc, char * argv[]) {
+	if (argc < 3) {
+		std::cout << "Usage: " << argv[0] << " <corpus directory> <image>..." << std::endl;
+		return 1;
+	}
+
+	std::string out_dir = argv[1];
+	mkdir(out_dir.c_str(), 0755);
+	mkdir((out_dir + "/rle").c_str(), 0755);
+	mkdir((out_dir + "/huffman").c_str(), 0755);
+
+	for (int i = 2; i < argc; ++i) {
+		if (!addSeeds(argv[i], out_dir)) {
+			std::cout << "Can't encode image: " << argv[i] << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
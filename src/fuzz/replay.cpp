@@ -0,0 +1,71 @@
+/*!
+ * \file
+ * \brief Runs fuzz target over corpus without libFuzzer
+ *
+ * Every argument is an input file or a directory of them. Each input is passed
+ * to the target once, total time and throughput are printed at the end, so
+ * the seed corpus also serves as a regression and slowdown check.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+
+#include <dirent.h>
+#include <stdint.h>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size);
+
+static void listInputs(const std::string & path, std::vector<std::string> & inputs) {
+	DIR * dir = opendir(path.c_str());
+	if (!dir) {
+		inputs.push_back(path);
+		return;
+	}
+
+	std::vector<std::string> names;
+	while (struct dirent * entry = readdir(dir))
+		if (entry->d_name[0] != '.')
+			names.push_back(path + "/" + entry->d_name);
+	closedir(dir);
+
+	std::sort(names.begin(), names.end());
+	inputs.insert(inputs.end(), names.begin(), names.end());
+}
+
+int main(int argc, char * argv[]) {
+	std::vector<std::string> inputs;
+	for (int i = 1; i < argc; ++i)
+		listInputs(argv[i], inputs);
+
+	if (inputs.empty()) {
+		std::cout << "Usage: " << argv[0] << " <file or directory>..." << std::endl;
+		return 1;
+	}
+
+	int64_t bytes = 0;
+	double seconds = 0;
+
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		std::ifstream f(inputs[i].c_str(), std::ios_base::in | std::ios_base::binary);
+		if (!f) {
+			std::cout << "Can't read input: " << inputs[i] << std::endl;
+			return 1;
+		}
+		std::vector<char> data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		LLVMFuzzerTestOneInput((const uint8_t*)data.data(), data.size());
+		seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		bytes += data.size();
+	}
+
+	std::cout << argv[0] << ": " << inputs.size() << " inputs, " << bytes << " bytes, "
+			<< seconds << " s, " << (seconds > 0 ? bytes / seconds / 1e6 : 0) << " MB/s" << std::endl;
+
+	return 0;
+}
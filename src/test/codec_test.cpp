@@ -0,0 +1,725 @@
+/*!
+ * \file
+ * \brief Round-trip and speed tests of the codec
+ *
+ * Suites (first argument):
+ * - roundtrip: codes images with every combination of conversion, Gray coding,
+ *   prediction and Huffman post-processing and checks that decoded image is
+ *   bit-exact. HSV and Bayer are lossy, their output must equal the conversion
+ *   alone and the loss is printed.
+ * - codebooks: codes every bit plane with every fixed RleCodebook type, with
+ *   codebook fitted to the plane, with Huffman coded run classes and with READ
+ *   codes and checks both RLE decoders.
+ * - perf: measures encode and decode MB/s and compares them with baseline.
+ * - cases: round-trips of single images and options the roundtrip matrix
+ *   doesn't cover: runs longer than any fixed codebook codes, lossy -P and
+ *   --psnr coding, and -A picking the best configuration it tries.
+ * - malformed: decodes crafted files with well-formed records but header
+ *   fields the decoder must refuse, they must fail instead of crashing.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <cv.h>
+#include <highgui.h>
+
+#include <boost/program_options.hpp>
+
+#include "codec.h"
+
+#ifndef RLE_DATA_DIR
+#define RLE_DATA_DIR "."
+#endif
+
+namespace po = boost::program_options;
+
+static const char * conversions[] = { "", "RGB", "HSV", "Bayer", "Raw", "YCoCg" };
+
+// ===============================================================================================
+//
+// Test images
+//
+// ===============================================================================================
+
+/*!
+ * Image given by function of position and channel, \a depth bits per sample.
+ */
+template <typename F>
+static cv::Mat makeImage(int width, int height, int channels, int depth, F value) {
+	cv::Mat img(height, width, CV_MAKETYPE(depth > 8 ? CV_16U : CV_8U, channels));
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+			for (int c = 0; c < channels; ++c) {
+				int v = value(x, y, c) & ((1 << depth) - 1);
+				if (depth > 8)
+					img.ptr <uint16_t> (y)[x * channels + c] = v;
+				else
+					img.ptr <uchar> (y)[x * channels + c] = v;
+			}
+	return img;
+}
+
+static int noise(int x, int y, int c) {
+	// fixed hash, same image on every run
+	uint32_t h = (x * 73856093u) ^ (y * 19349663u) ^ (c * 83492791u);
+	h ^= h >> 13;
+	h *= 0x5bd1e995u;
+	return h ^ (h >> 15);
+}
+
+static int constant(int, int, int) {
+	return 77;
+}
+
+static int checkerboard(int x, int y, int) {
+	return (x + y) % 2 ? 0xFFFF : 0;
+}
+
+static int gradient(int x, int y, int c) {
+	return x * 7 + y * 3 + c * 50;
+}
+
+/*!
+ * Writes synthetic images into files named \a prefix + name, returns their
+ * names.
+ */
+static std::vector<std::string> syntheticImages(const std::string & prefix) {
+	std::vector<std::pair<std::string, cv::Mat> > images;
+	images.push_back(std::make_pair("const.bmp", makeImage(64, 48, 3, 8, constant)));
+	images.push_back(std::make_pair("checker.bmp", makeImage(64, 48, 3, 8, checkerboard)));
+	images.push_back(std::make_pair("noise.bmp", makeImage(64, 48, 3, 8, noise)));
+	images.push_back(std::make_pair("odd.bmp", makeImage(37, 23, 3, 8, gradient)));
+	images.push_back(std::make_pair("row.bmp", makeImage(97, 1, 3, 8, noise)));
+	images.push_back(std::make_pair("col.bmp", makeImage(1, 97, 3, 8, noise)));
+	images.push_back(std::make_pair("noise12.ppm", makeImage(33, 17, 3, 12, noise)));
+	images.push_back(std::make_pair("gray16.pgm", makeImage(31, 19, 1, 16, noise)));
+
+	std::vector<std::string> names;
+	for (size_t i = 0; i < images.size(); ++i) {
+		std::string fname = prefix + images[i].first;
+		cv::imwrite(fname.c_str(), images[i].second);
+		names.push_back(fname);
+	}
+	return names;
+}
+
+static std::string baseName(const std::string & fname) {
+	return fname.substr(fname.find_last_of('/') + 1);
+}
+
+static bool sameImage(const cv::Mat & a, const cv::Mat & b) {
+	if (a.size() != b.size() || a.type() != b.type())
+		return false;
+	for (int y = 0; y < a.size().height; ++y)
+		if (memcmp(a.ptr <uchar> (y), b.ptr <uchar> (y), a.size().width * a.elemSize()) != 0)
+			return false;
+	return true;
+}
+
+static double psnr(const cv::Mat & a, const cv::Mat & b) {
+	double sum = 0;
+	int n = a.size().width * a.channels();
+	for (int y = 0; y < a.size().height; ++y)
+		for (int x = 0; x < n; ++x) {
+			double d = (double)a.ptr <uchar> (y)[x] - b.ptr <uchar> (y)[x];
+			sum += d * d;
+		}
+	double mse = sum / ((double)n * a.size().height);
+	return mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : 99;
+}
+
+// ===============================================================================================
+//
+// Configurations
+//
+// ===============================================================================================
+
+struct Config {
+	int conversion;
+	bool gray;
+	bool exor;
+	bool post;
+
+	std::string name() const {
+		std::string s = conversions[conversion];
+		if (gray)
+			s += " -G";
+		if (exor)
+			s += " -X";
+		if (post)
+			s += " -H";
+		return s;
+	}
+};
+
+static std::vector<Config> allConfigs() {
+	std::vector<Config> configs;
+	for (int conversion = 1; conversion <= 5; ++conversion)
+		for (int gray = 0; gray < 2; ++gray)
+			for (int exor = 0; exor < 2; ++exor)
+				for (int post = 0; post < 2; ++post) {
+					Config c = { conversion, gray != 0, exor != 0, post != 0 };
+					configs.push_back(c);
+				}
+	return configs;
+}
+
+static Header makeHeader(const Config & config) {
+	Header header;
+	header.conversion = config.conversion;
+	header.gray = config.gray;
+	header.exor = config.exor;
+	header.post = config.post;
+	return header;
+}
+
+/*!
+ * Image as the encoder reads it for \a conversion.
+ */
+static cv::Mat loadInput(const std::string & fname, int conversion) {
+	int flags = conversion == 4 ? CV_LOAD_IMAGE_GRAYSCALE : CV_LOAD_IMAGE_COLOR;
+	return cv::imread(fname.c_str(), CV_LOAD_IMAGE_ANYDEPTH | flags);
+}
+
+/*!
+ * False for configurations the encoder rejects for \a img.
+ */
+static bool supported(const cv::Mat & img, int conversion) {
+	int depth = imageDepth(img);
+	if (depth > 8 && (conversion == 2 || conversion == 3))
+		return false;
+	if (depth > 12 && conversion == 5)
+		return false;
+	// demosaicing needs at least one whole 2x2 cell
+	if (conversion == 3 && (img.size().width < 2 || img.size().height < 2))
+		return false;
+	return true;
+}
+
+/*!
+ * Expected decoder output: the input itself, or the input passed through the
+ * lossy conversion alone.
+ */
+static cv::Mat expected(const cv::Mat & img, int conversion) {
+	cv::Mat res;
+	if (conversion == 2) {
+		cv::Mat hsv;
+		cv::cvtColor(img, hsv, CV_BGR2HSV);
+		cv::cvtColor(hsv, res, CV_HSV2BGR);
+	} else if (conversion == 3) {
+		std::vector<cv::Mat> channels = bayerSplit(img);
+		cv::cvtColor(bayerMerge(channels), res, CV_BayerBG2BGR);
+	} else {
+		res = img;
+	}
+	return res;
+}
+
+static std::string decodedName(const std::string & tmp, const cv::Mat & img) {
+	if (img.depth() != CV_16U)
+		return tmp + ".bmp";
+	return tmp + (img.channels() == 1 ? ".pgm" : ".ppm");
+}
+
+// ===============================================================================================
+//
+// Suites
+//
+// ===============================================================================================
+
+static int roundtrip(const std::vector<std::string> & inputs, const std::string & tmp) {
+	std::vector<Config> configs = allConfigs();
+	std::string coded_fname = tmp + ".rle";
+	int failed = 0;
+	int passed = 0;
+	// shared by all images and configurations, so buffers left by one must not affect the next
+	CodecContext context;
+
+	for (size_t i = 0; i < inputs.size(); ++i)
+		for (size_t k = 0; k < configs.size(); ++k) {
+			const Config & config = configs[k];
+			cv::Mat img = loadInput(inputs[i], config.conversion);
+			if (img.empty()) {
+				std::cout << "Can't load image from file: " << inputs[i] << std::endl;
+				return 1;
+			}
+
+			if (!supported(img, config.conversion))
+				continue;
+
+			cv::Mat ref = expected(img, config.conversion);
+			std::string decoded_fname = decodedName(tmp, ref);
+			std::string what = baseName(inputs[i]) + " [" + config.name() + "]";
+
+			if (!encode(inputs[i], coded_fname, makeHeader(config), NULL, &context) || !decode(coded_fname, decoded_fname, NULL, &context)) {
+				std::cout << "FAIL " << what << ": coding failed" << std::endl;
+				failed++;
+				continue;
+			}
+
+			cv::Mat res = cv::imread(decoded_fname.c_str(), CV_LOAD_IMAGE_UNCHANGED);
+			if (!sameImage(ref, res)) {
+				std::cout << "FAIL " << what << ": decoded image differs" << std::endl;
+				failed++;
+				continue;
+			}
+
+			if (config.conversion == 2 || config.conversion == 3)
+				std::cout << "lossy " << what << ": PSNR " << psnr(img, ref) << " dB" << std::endl;
+
+			passed++;
+			std::remove(decoded_fname.c_str());
+		}
+
+	std::remove(coded_fname.c_str());
+	std::cout << passed << " passed, " << failed << " failed" << std::endl;
+	return failed ? 1 : 0;
+}
+
+/*!
+ * Codes \a img with \a header through files prefixed \a tmp and decodes it
+ * into \a res, coded size is returned in \a bytes. False if coding fails.
+ */
+static bool codeImage(const cv::Mat & img, const Header & header, const std::string & tmp, cv::Mat & res, long & bytes) {
+	std::string in_fname = decodedName(tmp + ".in", img);
+	std::string coded_fname = tmp + ".rle";
+	std::string decoded_fname = decodedName(tmp, img);
+	cv::imwrite(in_fname.c_str(), img);
+
+	bool ok = encode(in_fname, coded_fname, header) && decode(coded_fname, decoded_fname);
+	if (ok) {
+		std::ifstream f(coded_fname.c_str(), std::ios_base::in | std::ios_base::binary | std::ios_base::ate);
+		bytes = f.tellg();
+		res = cv::imread(decoded_fname.c_str(), CV_LOAD_IMAGE_UNCHANGED);
+	}
+
+	std::remove(in_fname.c_str());
+	std::remove(coded_fname.c_str());
+	std::remove(decoded_fname.c_str());
+	return ok;
+}
+
+/*!
+ * True if every value of \a res is the one of \a img with \a dropped lowest
+ * bits replaced by their midpoint.
+ */
+static bool midpointFilled(const cv::Mat & img, const cv::Mat & res, int dropped) {
+	if (img.size() != res.size() || img.type() != res.type())
+		return false;
+	int keep = ~((1 << dropped) - 1);
+	int fill = 1 << (dropped - 1);
+	int n = img.size().width * img.channels();
+	for (int y = 0; y < img.size().height; ++y)
+		for (int x = 0; x < n; ++x)
+			if (res.ptr <uchar> (y)[x] != ((img.ptr <uchar> (y)[x] & keep) | fill))
+				return false;
+	return true;
+}
+
+static int cases(const std::string & tmp) {
+	int failed = 0;
+	int passed = 0;
+	cv::Mat res;
+	long bytes;
+
+	struct Check {
+		Check(int & passed, int & failed) : passed(passed), failed(failed) {}
+		void operator()(bool ok, const std::string & what) {
+			if (ok) {
+				passed++;
+			} else {
+				std::cout << "FAIL " << what << std::endl;
+				failed++;
+			}
+		}
+		int & passed;
+		int & failed;
+	} check(passed, failed);
+
+	{
+		// one run of the whole plane, longer than the last interval of fixed codebooks
+		cv::Mat img = makeImage(8192, 4097, 3, 8, constant);
+		Header header;
+		check(codeImage(img, header, tmp, res, bytes) && sameImage(img, res), "long run: not decoded to the input");
+	}
+
+	cv::Mat img = makeImage(64, 48, 3, 8, noise);
+
+	{
+		// 2 planes dropped, so no value is more than 2 off: PSNR is above 42 dB
+		Header header;
+		header.gray = true;
+		header.exor = true;
+		for (int i = 0; i < MAX_CHANNELS; ++i)
+			header.planes[i] = 6;
+		check(codeImage(img, header, tmp, res, bytes) && midpointFilled(img, res, 2), "-P 6: dropped planes not filled with midpoint");
+		check(!res.empty() && psnr(img, res) >= 10 * log10(255.0 * 255.0 / 4), "-P 6: PSNR below the bound");
+	}
+
+	for (int conversion = 1; conversion <= 5; ++conversion) {
+		if (conversion == 3 || conversion == 4)
+			continue;
+		Header header;
+		header.conversion = conversion;
+		header.gray = true;
+		header.exor = true;
+		header.psnr = 40;
+		std::string what = std::string("--psnr 40 [") + conversions[conversion] + "]";
+		// HSV loss is measured from the conversion alone
+		cv::Mat ref = expected(img, conversion);
+		bool ok = codeImage(img, header, tmp, res, bytes);
+		check(ok && res.size() == ref.size() && res.type() == ref.type() && psnr(ref, res) >= 40, what + ": PSNR below target");
+		if (ok && res.size() == ref.size() && res.type() == ref.type())
+			std::cout << what << ": PSNR " << psnr(ref, res) << " dB, " << bytes << " bytes" << std::endl;
+		check(ok && !sameImage(ref, res), what + ": no planes dropped");
+	}
+
+	// images of fewer rows than autoHeader() samples are estimated whole, so
+	// the configuration it picks must code them best of those it tries
+	std::vector<std::pair<std::string, cv::Mat> > images;
+	images.push_back(std::make_pair("noise", img));
+	images.push_back(std::make_pair("gradient", makeImage(64, 48, 3, 8, gradient)));
+	images.push_back(std::make_pair("checker", makeImage(64, 48, 3, 8, checkerboard)));
+	images.push_back(std::make_pair("noise12", makeImage(33, 17, 3, 12, noise)));
+	images.push_back(std::make_pair("gray16", makeImage(31, 19, 1, 16, noise)));
+
+	for (size_t k = 0; k < images.size(); ++k) {
+		const cv::Mat & image = images[k].second;
+		std::string what = "-A " + images[k].first;
+		Header header;
+		header.conversion = 0;
+		long auto_bytes;
+		check(codeImage(image, header, tmp, res, auto_bytes) && sameImage(image, res), what + ": not decoded to the input");
+
+		long best = -1;
+		std::string best_name;
+		std::vector<Config> configs = allConfigs();
+		for (size_t c = 0; c < configs.size(); ++c) {
+			// autoHeader() tries lossless conversions only, with post-processing of the header
+			if ((configs[c].conversion != 1 && configs[c].conversion != 5) || configs[c].post
+					|| !supported(image, configs[c].conversion))
+				continue;
+			if (codeImage(image, makeHeader(configs[c]), tmp, res, bytes) && (best < 0 || bytes < best)) {
+				best = bytes;
+				best_name = configs[c].name();
+			}
+		}
+		check(best >= 0 && auto_bytes <= best, what + ": larger than [" + best_name + "]");
+		std::cout << what << ": " << auto_bytes << " bytes, best fixed [" << best_name << "] " << best << std::endl;
+	}
+
+	std::cout << passed << " passed, " << failed << " failed" << std::endl;
+	return failed ? 1 : 0;
+}
+
+static bool checkPlane(const cv::Mat & ch, int p, RleBuffer buf) {
+	RleBuffer copy = buf;
+
+	PackedPlane plane;
+	if (rle(buf, plane) < 0)
+		return false;
+	cv::Mat bytes = rle(copy);
+	if (bytes.size() != ch.size())
+		return false;
+
+	for (int y = 0; y < ch.size().height; ++y)
+		for (int x = 0; x < ch.size().width; ++x) {
+			int v = ch.depth() == CV_16U ? ch.ptr <uint16_t> (y)[x] : ch.ptr <uchar> (y)[x];
+			int bit = (v >> p) & 1;
+			if ((int)((plane.row(y)[x >> 6] >> (x & 63)) & 1) != bit || bytes.ptr <uchar> (y)[x] != (bit ? 255 : 0))
+				return false;
+		}
+	return true;
+}
+
+static int codebooks(const std::vector<std::string> & inputs) {
+	int failed = 0;
+	int passed = 0;
+
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		cv::Mat img = loadInput(inputs[i], 1);
+		if (img.empty()) {
+			std::cout << "Can't load image from file: " << inputs[i] << std::endl;
+			return 1;
+		}
+
+		std::vector<cv::Mat> channels;
+		cv::split(img, channels);
+
+		for (size_t c = 0; c < channels.size(); ++c)
+			for (int p = 0; p < imageDepth(img); ++p)
+				// type 7 stands for PLANE_HUFFMAN, 8 for PLANE_READ
+				for (int type = 0; type <= 8; ++type) {
+					RleBuffer buf;
+					cv::Size size = channels[c].size();
+					// run length codebook streams must stay within the room reserved for them
+					bool fits = true;
+					if (type < RleCodebook::ADAPTIVE) {
+						buf = rle(channels[c], p, type);
+						fits = buf.size() <= RleBuffer::maxSize(RleCodebook(type), size.width, size.height);
+					} else if (type == RleCodebook::ADAPTIVE) {
+						RunHistogram hist;
+						scanRuns(channels[c], p, hist);
+						int sz;
+						RleCodebook cb = hist.fit(sz);
+						buf = rle(channels[c], p, cb);
+						fits = buf.size() <= RleBuffer::maxSize(cb, size.width, size.height);
+					} else if (type == 7) {
+						buf = rleClasses(channels[c], p);
+					} else {
+						buf = rleRead(channels[c], p);
+					}
+					if (fits && checkPlane(channels[c], p, buf)) {
+						passed++;
+						continue;
+					}
+					std::cout << "FAIL " << baseName(inputs[i]) << " channel " << c << " plane " << p
+							<< " codebook " << type << std::endl;
+					failed++;
+				}
+	}
+
+	std::cout << passed << " passed, " << failed << " failed" << std::endl;
+	return failed ? 1 : 0;
+}
+
+/*!
+ * Writes coded file with \a header and records of blank \a width x \a height
+ * planes for every plane of its channels, laid out as the encoder does it.
+ */
+static void writeBlankFile(const std::string & fname, const Header & header, int width, int height) {
+	std::ofstream f(fname.c_str(), std::ios_base::out | std::ios_base::binary);
+	writeHeader(f, header);
+
+	cv::Mat blank = cv::Mat::zeros(height, width, CV_8UC1);
+	std::ostringstream data;
+	rle(blank, 0, 0).saveToFile(data);
+
+	for (int i = 0; i < header.channels; ++i) {
+		// YCoCg-R chroma has one plane more
+		int depth = header.conversion == 5 && i > 0 ? header.depth + 1 : header.depth;
+		for (int p = 0; p < depth; ++p) {
+			PlaneRecord record;
+			record.channel = i;
+			record.plane = p;
+			record.data = data.str();
+			writeRecord(f, record, header.crc);
+		}
+	}
+}
+
+static int malformed(const std::string & tmp) {
+	struct Case {
+		const char * name;
+		int conversion;
+		int channels;
+		int depth;
+		bool valid;
+	};
+	// depth 7 decodes YCoCg chroma to 8-bit channels, that the inverse
+	// transform would read as 16-bit ones
+	const Case cases[] = {
+		{ "YCoCg depth 8", 5, 3, 8, true },
+		{ "YCoCg depth 12", 5, 3, 12, true },
+		{ "YCoCg depth 7", 5, 3, 7, false },
+		{ "YCoCg depth 13", 5, 3, 13, false },
+		{ "YCoCg 2 channels", 5, 2, 8, false },
+		{ "HSV depth 12", 2, 3, 12, false },
+	};
+
+	std::string coded_fname = tmp + ".rle";
+	std::string decoded_fname = tmp + ".ppm";
+	int failed = 0;
+	int passed = 0;
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		Header header;
+		header.conversion = cases[i].conversion;
+		header.channels = cases[i].channels;
+		header.depth = cases[i].depth;
+		writeBlankFile(coded_fname, header, 37, 5);
+
+		if (decode(coded_fname, decoded_fname) == cases[i].valid) {
+			passed++;
+		} else {
+			std::cout << "FAIL " << cases[i].name << ": " << (cases[i].valid ? "not decoded" : "decoded") << std::endl;
+			failed++;
+		}
+		std::remove(decoded_fname.c_str());
+	}
+
+	std::remove(coded_fname.c_str());
+	std::cout << passed << " passed, " << failed << " failed" << std::endl;
+	return failed ? 1 : 0;
+}
+
+/*!
+ * Time of coding itself, without reading and writing files.
+ */
+static double computeTime(const StageTimes & t) {
+	return t.split + t.gray + t.exor + t.rle + t.huffman + t.search;
+}
+
+static int perf(const std::vector<std::string> & inputs, const std::string & tmp, int repeat,
+		const std::string & baseline_fname, double tolerance, bool update) {
+	std::map<std::string, std::pair<double, double> > baseline;
+
+	std::ifstream in(baseline_fname.c_str());
+	std::string line;
+	std::getline(in, line);
+	while (std::getline(in, line)) {
+		size_t comma = line.rfind(',');
+		size_t comma2 = line.rfind(',', comma - 1);
+		if (comma == std::string::npos || comma2 == std::string::npos)
+			continue;
+		baseline[line.substr(0, comma2)] = std::make_pair(atof(line.substr(comma2 + 1).c_str()), atof(line.substr(comma + 1).c_str()));
+	}
+
+	std::ostringstream measured;
+	measured << "image,config,enc_mbps,dec_mbps\n";
+
+	std::vector<Config> configs = allConfigs();
+	std::string coded_fname = tmp + ".rle";
+	std::string decoded_fname = tmp + ".bmp";
+	int failed = 0;
+
+	for (size_t i = 0; i < inputs.size(); ++i)
+		for (size_t k = 0; k < configs.size(); ++k) {
+			const Config & config = configs[k];
+			// raw mosaic needs single channel input
+			if (config.conversion == 4)
+				continue;
+
+			double enc = 0;
+			double dec = 0;
+			double raw_bytes = 0;
+			for (int r = 0; r < repeat; ++r) {
+				CodecStats enc_stats;
+				CodecStats dec_stats;
+				if (!encode(inputs[i], coded_fname, makeHeader(config), &enc_stats) || !decode(coded_fname, decoded_fname, &dec_stats)) {
+					std::cout << "Can't code image: " << inputs[i] << std::endl;
+					return 1;
+				}
+				raw_bytes = enc_stats.bytes_in;
+				if (r == 0 || computeTime(enc_stats.times) < enc)
+					enc = computeTime(enc_stats.times);
+				if (r == 0 || computeTime(dec_stats.times) < dec)
+					dec = computeTime(dec_stats.times);
+			}
+
+			double enc_mbps = raw_bytes / 1048576.0 / enc;
+			double dec_mbps = raw_bytes / 1048576.0 / dec;
+			std::string key = baseName(inputs[i]) + "," + config.name();
+			measured << key << "," << enc_mbps << "," << dec_mbps << "\n";
+
+			if (update || !baseline.count(key)) {
+				std::cout << key << ": " << enc_mbps << " / " << dec_mbps << " MB/s" << std::endl;
+				continue;
+			}
+
+			double enc_base = baseline[key].first;
+			double dec_base = baseline[key].second;
+			bool slow = enc_mbps < enc_base * (1 - tolerance) || dec_mbps < dec_base * (1 - tolerance);
+			std::cout << (slow ? "FAIL " : "") << key << ": " << enc_mbps << " / " << dec_mbps
+					<< " MB/s (baseline " << enc_base << " / " << dec_base << ")" << std::endl;
+			if (slow)
+				failed++;
+		}
+
+	std::remove(coded_fname.c_str());
+	std::remove(decoded_fname.c_str());
+
+	if (update) {
+		std::ofstream out(baseline_fname.c_str());
+		out << measured.str();
+		std::cout << "Baseline written to " << baseline_fname << std::endl;
+		return 0;
+	}
+
+	std::cout << failed << " configurations slower than baseline" << std::endl;
+	return failed ? 1 : 0;
+}
+
+int main(int argc, char * argv[]) {
+	std::string suite;
+	std::string tmp_fname;
+	std::string baseline_fname;
+	double tolerance;
+	int repeat;
+	std::vector<std::string> inputs;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("suite", po::value<std::string>(&suite), "roundtrip, codebooks, perf, cases or malformed")
+		("input,I", po::value<std::vector<std::string> >(&inputs), "images to test (bundled ones by default)")
+		("synthetic,S", "test synthetic images (instead of bundled ones)")
+		("tmp,T", po::value<std::string>(&tmp_fname)->default_value("codec_test.tmp"), "prefix of scratch files")
+		("baseline,b", po::value<std::string>(&baseline_fname)->default_value(RLE_DATA_DIR "/src/test/baseline.csv"), "speeds to compare with (perf)")
+		("tolerance,t", po::value<double>(&tolerance)->default_value(0.5), "allowed slowdown as fraction of baseline (perf)")
+		("repeat,r", po::value<int>(&repeat)->default_value(3), "runs per configuration, fastest one is compared (perf)")
+		("update", "write measured speeds as new baseline (perf)")
+	;
+
+	po::positional_options_description pos;
+	pos.add("suite", 1);
+	pos.add("input", -1);
+
+	po::variables_map vm;
+
+	try {
+		po::store(po::command_line_parser(argc, argv).options(desc).positional(pos).run(), vm);
+		po::notify(vm);
+	}
+	catch (const po::error & u) {
+		std::cout << u.what() << "\n";
+		return 1;
+	}
+
+	if (vm.count("help") || suite.empty()) {
+		std::cout << desc << "\n";
+		return vm.count("help") ? 0 : 1;
+	}
+
+	std::vector<std::string> synthetic;
+	if (vm.count("synthetic")) {
+		synthetic = syntheticImages(tmp_fname + ".");
+		inputs.insert(inputs.end(), synthetic.begin(), synthetic.end());
+	} else if (inputs.empty()) {
+		inputs.push_back(RLE_DATA_DIR "/lena.bmp");
+		inputs.push_back(RLE_DATA_DIR "/peppers.bmp");
+		inputs.push_back(RLE_DATA_DIR "/f16.bmp");
+	}
+
+	if (repeat < 1)
+		repeat = 1;
+
+	int result;
+	if (suite == "roundtrip") {
+		result = roundtrip(inputs, tmp_fname);
+	} else if (suite == "codebooks") {
+		result = codebooks(inputs);
+	} else if (suite == "perf") {
+		result = perf(inputs, tmp_fname, repeat, baseline_fname, tolerance, vm.count("update") > 0);
+	} else if (suite == "cases") {
+		result = cases(tmp_fname);
+	} else if (suite == "malformed") {
+		result = malformed(tmp_fname);
+	} else {
+		std::cout << "Unknown suite: " << suite << std::endl;
+		return 1;
+	}
+
+	for (size_t i = 0; i < synthetic.size(); ++i)
+		std::remove(synthetic[i].c_str());
+
+	return result;
+}